@@ -0,0 +1,389 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <thread>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* Benchmark driver for the three programs: runs every variant over a matrix of inputs and
+    thread counts, with warmup runs and repetitions, collecting the phase timings they
+    report through HUF_REPORT (see report.hpp) together with the wall time of every run.
+    Results are summarized per phase with median and percentiles, and compared with the
+    sequential version for speedup and efficiency */
+
+struct Config {
+    std::string variant;
+    std::string mode; // "compress" or "decompress"
+    std::string input;
+    uint64_t bytes;
+    int threads;
+};
+
+// Phase timings of the repetitions of a configuration, in usecs
+struct Result {
+    Config config;
+    std::map<std::string, std::vector<long>> phases;
+};
+
+struct Options {
+    std::vector<std::string> variants = {"seq", "par", "ff"};
+    std::vector<int> threads;
+    int warmups = 1;
+    int reps = 5;
+    bool decompress = false;
+    std::string json = "bench.json";
+    std::string csv = "bench.csv";
+    std::string binaries = ".";
+    std::vector<std::string> inputs;
+};
+
+std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+
+    return items;
+}
+
+// Powers of two up to the number of hardware threads, and that number itself
+std::vector<int> defaultThreads() {
+    int hw = std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<int> threads;
+    for (int t = 1; t < hw; t *= 2)
+        threads.push_back(t);
+    threads.push_back(hw);
+
+    return threads;
+}
+
+// Value at percentile p of sorted samples, interpolating between the closest ranks
+double percentile(const std::vector<long>& sorted, const double p) {
+    if (sorted.empty())
+        return 0;
+
+    double rank = p / 100 * (sorted.size() - 1);
+    size_t lo = static_cast<size_t>(rank);
+    size_t hi = std::min(lo + 1, sorted.size() - 1);
+
+    return sorted[lo] + (rank - lo) * (sorted[hi] - sorted[lo]);
+}
+
+/* Runs a program once in the directory of its input, as the output files are named after
+    the input; its output is discarded and its phases are read back from the report file */
+bool runOnce(
+    const std::string& binary,
+    const std::vector<std::string>& args,
+    const std::string& directory,
+    const std::string& report,
+    std::map<std::string, long>& phases
+) {
+    if (truncate(report.c_str(), 0) != 0) {
+        std::cerr << "Could not reset the report file" << std::endl;
+        return false;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Could not start " << binary << std::endl;
+        return false;
+    }
+
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+
+        if (chdir(directory.c_str()) != 0)
+            _exit(127);
+
+        setenv("HUF_REPORT", report.c_str(), 1);
+
+        std::vector<char*> argv;
+        argv.push_back(const_cast<char*>(binary.c_str()));
+        for (const std::string& a : args)
+            argv.push_back(const_cast<char*>(a.c_str()));
+        argv.push_back(nullptr);
+
+        execv(binary.c_str(), argv.data());
+        _exit(127);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    long wall = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cerr << binary << " failed on " << directory << "/" << args[0] << std::endl;
+        return false;
+    }
+
+    // A phase reported more than once in a run, e.g. by several farms, is summed
+    phases.clear();
+    std::ifstream in(report);
+    std::string phase;
+    long usecs;
+    while (in >> phase >> usecs)
+        phases[phase] += usecs;
+    phases["wall"] = wall;
+
+    return true;
+}
+
+bool runConfig(
+    const Options& opt,
+    const Config& config,
+    const std::string& report,
+    Result& result
+) {
+    char path[PATH_MAX];
+    std::string binary = opt.binaries + "/" + config.variant;
+    if (!realpath(binary.c_str(), path)) {
+        std::cerr << "Could not find " << binary << std::endl;
+        return false;
+    }
+
+    size_t slash = config.input.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "." : config.input.substr(0, std::max<size_t>(slash, 1));
+    std::string name = config.input.substr(slash + 1);
+
+    std::vector<std::string> args;
+    if (config.mode == "decompress")
+        args.push_back("compressed_" + name);
+    else
+        args.push_back(name);
+    if (config.variant != "seq")
+        args.push_back(std::to_string(config.threads));
+    if (config.mode == "decompress")
+        args.push_back("d");
+
+    result.config = config;
+    std::map<std::string, long> phases;
+    for (int r = 0; r < opt.warmups + opt.reps; ++r) {
+        if (!runOnce(path, args, directory, report, phases))
+            return false;
+
+        if (r < opt.warmups)
+            continue;
+
+        for (const auto& [phase, usecs] : phases)
+            result.phases[phase].push_back(usecs);
+    }
+
+    return true;
+}
+
+// Sequential run of the same input and mode, the baseline of speedup and efficiency, if any
+const Result* baseline(const std::vector<Result>& results, const Config& config) {
+    for (const Result& r : results)
+        if (r.config.variant == "seq" && r.config.mode == config.mode && r.config.input == config.input)
+            return &r;
+
+    return nullptr;
+}
+
+struct Summary {
+    double median, p10, p90, min, max, mean;
+};
+
+Summary summarize(std::vector<long> samples) {
+    std::sort(samples.begin(), samples.end());
+
+    return {
+        percentile(samples, 50),
+        percentile(samples, 10),
+        percentile(samples, 90),
+        static_cast<double>(samples.front()),
+        static_cast<double>(samples.back()),
+        std::accumulate(samples.begin(), samples.end(), 0.0) / samples.size()
+    };
+}
+
+std::string jsonString(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+
+    return out + "\"";
+}
+
+void writeResults(const Options& opt, const std::vector<Result>& results) {
+    std::ofstream json(opt.json);
+    std::ofstream csv(opt.csv);
+
+    json << "{\n  \"warmups\": " << opt.warmups << ",\n  \"repetitions\": " << opt.reps << ",\n  \"results\": [";
+    csv << "variant,mode,input,bytes,threads,phase,median_us,p10_us,p90_us,min_us,max_us,mean_us,speedup,efficiency,mb_per_s\n";
+
+    for (size_t k = 0; k < results.size(); ++k) {
+        const Result& r = results[k];
+        const Config& c = r.config;
+        const Result* base = baseline(results, c);
+
+        json << (k ? "," : "") << "\n    {\"variant\": " << jsonString(c.variant) << ", \"mode\": " << jsonString(c.mode)
+            << ", \"input\": " << jsonString(c.input) << ", \"bytes\": " << c.bytes << ", \"threads\": " << c.threads
+            << ", \"phases\": {";
+
+        bool first = true;
+        for (const auto& [phase, samples] : r.phases) {
+            Summary s = summarize(samples);
+
+            // Against the sequential median of the same phase, where the sequential version has it
+            double speedup = 0;
+            if (base && base->phases.count(phase))
+                speedup = summarize(base->phases.at(phase)).median / std::max(1.0, s.median);
+            double efficiency = speedup / c.threads;
+            double throughput = c.bytes / std::max(1.0, s.median); // bytes per usec, i.e. MB/s
+
+            json << (first ? "" : ",") << "\n      " << jsonString(phase) << ": {\"median_us\": " << s.median
+                << ", \"p10_us\": " << s.p10 << ", \"p90_us\": " << s.p90 << ", \"min_us\": " << s.min
+                << ", \"max_us\": " << s.max << ", \"mean_us\": " << s.mean << ", \"mb_per_s\": " << throughput;
+            if (base && base->phases.count(phase))
+                json << ", \"speedup\": " << speedup << ", \"efficiency\": " << efficiency;
+            json << ", \"samples_us\": [";
+            for (size_t i = 0; i < samples.size(); ++i)
+                json << (i ? ", " : "") << samples[i];
+            json << "]}";
+            first = false;
+
+            csv << c.variant << "," << c.mode << "," << c.input << "," << c.bytes << "," << c.threads << "," << phase << ","
+                << s.median << "," << s.p10 << "," << s.p90 << "," << s.min << "," << s.max << "," << s.mean << ",";
+            if (base && base->phases.count(phase))
+                csv << speedup << "," << efficiency;
+            else
+                csv << ",";
+            csv << "," << throughput << "\n";
+        }
+
+        json << "\n    }}";
+    }
+
+    json << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+
+    int o;
+    while ((o = getopt(argc, argv, "v:t:w:r:dj:c:b:")) != -1) {
+        switch (o) {
+        case 'v':
+            opt.variants = split(optarg);
+            break;
+        case 't':
+            for (const std::string& t : split(optarg))
+                if (atoi(t.c_str()) > 0)
+                    opt.threads.push_back(atoi(t.c_str()));
+            break;
+        case 'w':
+            opt.warmups = std::max(0, atoi(optarg));
+            break;
+        case 'r':
+            opt.reps = std::max(1, atoi(optarg));
+            break;
+        case 'd':
+            opt.decompress = true;
+            break;
+        case 'j':
+            opt.json = optarg;
+            break;
+        case 'c':
+            opt.csv = optarg;
+            break;
+        case 'b':
+            opt.binaries = optarg;
+            break;
+        default:
+            std::cout << "Usage: " << argv[0] << " [-v seq,par,ff] [-t 1,2,4,...] [-w warmups] [-r repetitions] [-d] "
+                "[-j results.json] [-c results.csv] [-b binaries directory] input..." << std::endl;
+            return 1;
+        }
+    }
+
+    for (int a = optind; a < argc; ++a)
+        opt.inputs.push_back(argv[a]);
+
+    if (opt.inputs.empty()) {
+        std::cout << "Usage: " << argv[0] << " [-v seq,par,ff] [-t 1,2,4,...] [-w warmups] [-r repetitions] [-d] "
+            "[-j results.json] [-c results.csv] [-b binaries directory] input..." << std::endl;
+        return 1;
+    }
+
+    if (opt.threads.empty())
+        opt.threads = defaultThreads();
+
+    char reportPath[] = "/tmp/huf_report_XXXXXX";
+    int fd = mkstemp(reportPath);
+    if (fd < 0) {
+        std::cerr << "Could not create the report file" << std::endl;
+        return 1;
+    }
+    close(fd);
+
+    // Sequential runs first, as the baseline of the others; decompression reads what compression wrote
+    std::vector<std::string> variants = opt.variants;
+    std::stable_partition(variants.begin(), variants.end(), [](const std::string& v) { return v == "seq"; });
+
+    std::vector<Result> results;
+    bool ok = true;
+    for (const std::string& input : opt.inputs) {
+        struct stat st;
+        if (stat(input.c_str(), &st) != 0) {
+            std::cerr << "Could not open " << input << std::endl;
+            ok = false;
+            continue;
+        }
+
+        for (const std::string& variant : variants) {
+            std::vector<int> threads = variant == "seq" ? std::vector<int>{1} : opt.threads;
+
+            for (int t : threads) {
+                for (const std::string& mode : {std::string("compress"), std::string("decompress")}) {
+                    if (mode == "decompress" && !opt.decompress)
+                        continue;
+
+                    Config config{variant, mode, input, static_cast<uint64_t>(st.st_size), t};
+                    std::cout << variant << " " << mode << " " << input << " with " << t << " threads" << std::endl;
+
+                    Result result;
+                    if (!runConfig(opt, config, reportPath, result)) {
+                        ok = false;
+                        continue;
+                    }
+
+                    Summary wall = summarize(result.phases["wall"]);
+                    std::cout << "  wall median " << wall.median << " usecs, p10 " << wall.p10 << ", p90 " << wall.p90 << std::endl;
+
+                    results.push_back(std::move(result));
+                }
+            }
+        }
+    }
+
+    unlink(reportPath);
+
+    writeResults(opt, results);
+    std::cout << "Results written to " << opt.json << " and " << opt.csv << std::endl;
+
+    return ok ? 0 : 1;
+}
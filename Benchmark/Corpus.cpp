@@ -0,0 +1,256 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <stdlib.h>
+
+#include <getopt.h>
+
+/* Synthetic inputs of any size, reproducible from their seed: bytes are drawn independently
+    from a distribution over an alphabet of up to 256 symbols, the most frequent symbols being
+    a random permutation of the byte values, so that the skewed distributions also exercise
+    the bytes above 127. The mixed corpus is made of regions of random lengths, not aligned
+    to the blocks of the container, each with a distribution of its own */
+
+// xoshiro256**, seeded through splitmix64: the same seed gives the same file on every platform
+class Random {
+    std::array<uint64_t, 4> s;
+
+    static uint64_t rotl(const uint64_t x, const int k) { return (x << k) | (x >> (64 - k)); }
+
+public:
+    explicit Random(uint64_t seed) {
+        for (uint64_t& w : s) {
+            uint64_t z = (seed += 0x9e3779b97f4a7c15);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+            w = z ^ (z >> 31);
+        }
+    }
+
+    uint64_t next() {
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+
+        return result;
+    }
+
+    // Uniform in [0, n), with a negligible bias for the small n used here
+    uint64_t below(const uint64_t n) { return next() % n; }
+
+    double uniform() { return (next() >> 11) * 0x1.0p-53; }
+};
+
+/* Sampling in constant time from the weights of the symbols (Walker's alias method): a slot
+    is drawn uniformly, then either its own symbol or its alias, with the slot's probability */
+class AliasTable {
+    std::vector<uint32_t> threshold; // Probability of the slot's own symbol, scaled to 2^32
+    std::vector<uint8_t> own, alias;
+
+public:
+    AliasTable(const std::vector<uint8_t>& symbols, const std::vector<double>& weights) {
+        const size_t n = symbols.size();
+        double total = std::accumulate(weights.begin(), weights.end(), 0.0);
+
+        std::vector<double> scaled(n);
+        std::vector<size_t> small, large;
+        for (size_t k = 0; k < n; ++k) {
+            scaled[k] = weights[k] * n / total;
+            (scaled[k] < 1 ? small : large).push_back(k);
+        }
+
+        threshold.assign(n, UINT32_MAX);
+        own = symbols;
+        alias = symbols;
+
+        while (!small.empty() && !large.empty()) {
+            size_t s = small.back(), l = large.back();
+            small.pop_back();
+
+            threshold[s] = static_cast<uint32_t>(std::min(scaled[s] * 4294967296.0, 4294967295.0));
+            alias[s] = symbols[l];
+
+            scaled[l] -= 1 - scaled[s];
+            if (scaled[l] < 1) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+    }
+
+    uint8_t sample(Random& rng) const {
+        uint64_t r = rng.next();
+        uint64_t slot = ((r >> 32) * own.size()) >> 32;
+
+        return static_cast<uint32_t>(r) < threshold[slot] ? own[slot] : alias[slot];
+    }
+};
+
+struct Options {
+    std::string distribution = "zipf";
+    uint64_t size = 64 << 20;
+    uint64_t seed = 1;
+    int alphabet = 64;
+    double exponent = 1.0; // Zipf
+    double p = 0.2; // Geometric
+    uint64_t region = 1 << 20; // Mean length of the regions of the mixed corpus
+    std::string output;
+};
+
+const std::vector<std::string> DISTRIBUTIONS = {"uniform", "zipf", "geometric", "single", "binary"};
+
+// Size with an optional K, M or G suffix
+uint64_t parseSize(const std::string& s) {
+    uint64_t n = strtoull(s.c_str(), nullptr, 10);
+    switch (s.empty() ? 0 : toupper(s.back())) {
+    case 'G': return n << 30;
+    case 'M': return n << 20;
+    case 'K': return n << 10;
+    default: return n;
+    }
+}
+
+// Table of one of the basic distributions, over the first 'alphabet' symbols of 'order'
+AliasTable makeTable(
+    const std::string& distribution,
+    const std::array<uint8_t, 256>& order,
+    const int alphabet,
+    const double exponent,
+    const double p
+) {
+    int n = distribution == "single" ? 1 : distribution == "binary" ? 256 : alphabet;
+
+    std::vector<uint8_t> symbols(order.begin(), order.begin() + n);
+    std::vector<double> weights(n);
+    for (int k = 0; k < n; ++k) {
+        if (distribution == "zipf")
+            weights[k] = 1 / std::pow(k + 1, exponent);
+        else if (distribution == "geometric")
+            weights[k] = std::pow(1 - p, k);
+        else
+            weights[k] = 1;
+    }
+
+    return AliasTable(symbols, weights);
+}
+
+std::array<uint8_t, 256> permutation(Random& rng) {
+    std::array<uint8_t, 256> order;
+    std::iota(order.begin(), order.end(), 0);
+    for (int k = 255; k > 0; --k)
+        std::swap(order[k], order[rng.below(k + 1)]);
+
+    return order;
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+
+    auto usage = [&]() {
+        std::cout << "Usage: " << argv[0] << " [-d uniform|zipf|geometric|single|binary|mixed] [-s size[K|M|G]] "
+            "[-r seed] [-a alphabet size] [-z zipf exponent] [-p geometric parameter] [-R mixed region size[K|M|G]] output" << std::endl;
+        return 1;
+    };
+
+    int o;
+    while ((o = getopt(argc, argv, "d:s:r:a:z:p:R:")) != -1) {
+        switch (o) {
+        case 'd':
+            opt.distribution = optarg;
+            break;
+        case 's':
+            opt.size = parseSize(optarg);
+            break;
+        case 'r':
+            opt.seed = strtoull(optarg, nullptr, 10);
+            break;
+        case 'a':
+            opt.alphabet = std::clamp(atoi(optarg), 1, 256);
+            break;
+        case 'z':
+            opt.exponent = atof(optarg);
+            break;
+        case 'p':
+            opt.p = std::clamp(atof(optarg), 1e-6, 1.0);
+            break;
+        case 'R':
+            opt.region = std::max<uint64_t>(1, parseSize(optarg));
+            break;
+        default:
+            return usage();
+        }
+    }
+
+    bool mixed = opt.distribution == "mixed";
+    if (optind >= argc || (!mixed && std::find(DISTRIBUTIONS.begin(), DISTRIBUTIONS.end(), opt.distribution) == DISTRIBUTIONS.end()))
+        return usage();
+    opt.output = argv[optind];
+
+    std::ofstream out(opt.output, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "Could not create " << opt.output << std::endl;
+        return 1;
+    }
+
+    Random rng(opt.seed);
+    std::array<uint8_t, 256> order = permutation(rng);
+    AliasTable table = makeTable(opt.distribution, order, opt.alphabet, opt.exponent, opt.p);
+
+    std::array<uint64_t, 256> histogram{};
+    std::vector<char> buffer(1 << 20);
+    uint64_t regionLeft = 0, regions = 0;
+
+    for (uint64_t written = 0; written < opt.size;) {
+        uint64_t n = std::min<uint64_t>(buffer.size(), opt.size - written);
+
+        for (uint64_t k = 0; k < n; ++k) {
+            // A new region, with a basic distribution, alphabet and parameters of its own
+            if (mixed && regionLeft == 0) {
+                std::string d = DISTRIBUTIONS[rng.below(DISTRIBUTIONS.size())];
+                table = makeTable(d, permutation(rng), 1 + rng.below(256), 0.5 + 1.5 * rng.uniform(), 0.01 + 0.5 * rng.uniform());
+                regionLeft = 1 + rng.below(2 * opt.region);
+                ++regions;
+            }
+            --regionLeft;
+
+            uint8_t b = table.sample(rng);
+            buffer[k] = static_cast<char>(b);
+            ++histogram[b];
+        }
+
+        if (!out.write(buffer.data(), n)) {
+            std::cerr << "Could not write " << opt.output << std::endl;
+            return 1;
+        }
+        written += n;
+    }
+
+    // Empirical entropy of the bytes, the bound on the compressed size of an order-0 coder
+    double entropy = 0;
+    int symbols = 0;
+    for (uint64_t count : histogram) {
+        if (!count)
+            continue;
+        double q = static_cast<double>(count) / opt.size;
+        entropy -= q * std::log2(q);
+        ++symbols;
+    }
+
+    std::cout << opt.output << ": " << opt.size << " bytes, " << opt.distribution;
+    if (mixed)
+        std::cout << " (" << regions << " regions)";
+    std::cout << ", seed " << opt.seed << ", " << symbols << " symbols, entropy " << entropy << " bits per byte" << std::endl;
+
+    return 0;
+}
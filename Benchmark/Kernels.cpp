@@ -0,0 +1,336 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <stdlib.h>
+
+#include <getopt.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "histogram.hpp"
+#include "bitstream.hpp"
+#include "codes.hpp"
+#include "decoder.hpp"
+
+/* Microbenchmarks of the kernels shared by the three programs: histogram, code construction,
+    encoding, bit packing and decoding, each timed in isolation over a buffer held in cache
+    and over one far larger than the last level cache. Throughputs are given per input byte,
+    in GB/s and in bytes per cycle, the cycles being those of the time stamp counter, which
+    ticks at the nominal frequency of the CPU rather than at the current one */
+
+struct Options {
+    uint64_t inCache = 32 << 10;
+    uint64_t outOfCache = 256 << 20;
+    int reps = 5;
+    std::vector<std::string> kernels = {"histogram", "codes", "encode", "bitpack", "decode"};
+    std::string csv;
+    std::string input;
+};
+
+// Median of the repetitions of a kernel, per run over the whole buffer
+struct Measure {
+    double ns;
+    double cycles;
+};
+
+inline uint64_t cycles() {
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> items;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ','))
+        if (!item.empty())
+            items.push_back(item);
+
+    return items;
+}
+
+/* Buffer of the given size, made of the input file repeated, or without one of bytes drawn
+    from a geometric distribution, skewed about as much as a natural language text */
+std::string makeBuffer(const std::string& input, const uint64_t size) {
+    std::string sample;
+    if (!input.empty()) {
+        std::ifstream in(input, std::ios::binary);
+        sample.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    std::string buffer(size, '\0');
+    if (sample.empty()) {
+        std::mt19937_64 rng(42);
+        std::geometric_distribution<int> dist(0.08);
+        for (char& c : buffer)
+            c = static_cast<char>(' ' + std::min(dist(rng), 94));
+    } else {
+        for (uint64_t k = 0; k < size; k += sample.size())
+            sample.copy(buffer.data() + k, std::min<uint64_t>(sample.size(), size - k));
+    }
+
+    return buffer;
+}
+
+// Same steps as the programs, bounding the lengths to MAX_CODE_LENGTH
+CodeTable buildCodes(const Histogram& histogram) {
+    std::vector<char> symbols;
+    std::vector<uint64_t> freqs;
+    populateSymbolsAndFrequencies(histogram, symbols, freqs);
+
+    CodeLengths lengths = huffmanCodeLengths(symbols, freqs);
+    if (maxCodeLength(lengths) > MAX_CODE_LENGTH)
+        lengths = packageMerge(symbols, freqs, MAX_CODE_LENGTH);
+
+    return canonicalCodes(lengths);
+}
+
+/* Times 'kernel' over 'reps' repetitions, each of them calling it as many times as needed
+    to process at least 64 MiB, so that buffers in cache are timed over a long enough span
+    (a thousand times when it does not process bytes); the first call is a warmup, faulting
+    in the pages and filling the caches */
+Measure measure(const std::function<void()>& kernel, const uint64_t bytes, const int reps) {
+    const uint64_t calls = bytes ? std::max<uint64_t>(1, (64 << 20) / bytes) : 1000;
+
+    kernel();
+
+    std::vector<double> ns, cyc;
+    for (int r = 0; r < reps; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        uint64_t c0 = cycles();
+
+        for (uint64_t k = 0; k < calls; ++k)
+            kernel();
+
+        uint64_t c1 = cycles();
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+
+        ns.push_back(static_cast<double>(elapsed) / calls);
+        cyc.push_back(static_cast<double>(c1 - c0) / calls);
+    }
+
+    std::sort(ns.begin(), ns.end());
+    std::sort(cyc.begin(), cyc.end());
+
+    return {ns[ns.size() / 2], cyc[cyc.size() / 2]};
+}
+
+void printRow(
+    std::ostream* csv,
+    const std::string& kernel,
+    const std::string& buffer,
+    const uint64_t bytes,
+    const Measure& m
+) {
+    std::cout << std::left << std::setw(16) << kernel << std::setw(14) << buffer << std::right
+        << std::setw(12) << bytes << std::setw(14) << std::fixed << std::setprecision(1) << m.ns;
+
+    // Code construction does not depend on the size of the input
+    if (bytes) {
+        std::cout << std::setw(10) << std::setprecision(3) << bytes / m.ns;
+        if (m.cycles)
+            std::cout << std::setw(12) << bytes / m.cycles;
+    }
+    std::cout << std::endl;
+
+    if (csv) {
+        *csv << kernel << "," << buffer << "," << bytes << "," << m.ns << ",";
+        if (bytes)
+            *csv << bytes / m.ns << "," << (m.cycles ? bytes / m.cycles : 0);
+        else
+            *csv << ",";
+        *csv << "\n";
+    }
+}
+
+bool wanted(const Options& opt, const std::string& kernel) {
+    return std::find(opt.kernels.begin(), opt.kernels.end(), kernel) != opt.kernels.end();
+}
+
+// Runs every kernel over a buffer of the given size, its codes built from its own histogram
+void runBuffer(const Options& opt, const std::string& name, const uint64_t size, std::ostream* csv) {
+    std::string text = makeBuffer(opt.input, size);
+    const char* from = text.data();
+    const char* to = text.data() + text.size();
+
+    Histogram histogram{};
+    countSymbols(from, to, histogram);
+    CodeTable table = buildCodes(histogram);
+    uint64_t totalBits = encodedBits(histogram, table);
+
+    BitBuffer compressed;
+    compressed.allocate(totalBits);
+
+    if (wanted(opt, "histogram")) {
+        Histogram h;
+        printRow(csv, "histogram", name, size, measure([&] {
+            h.fill(0);
+            countSymbols(from, to, h);
+            asm volatile("" : : "r"(h.data()) : "memory");
+        }, size, opt.reps));
+    }
+
+    // The kernel chosen for the CPU, then the scalar one it is compared with
+    Measure scalarEncode{0, 0};
+    if (wanted(opt, "encode")) {
+        Measure dispatched = measure([&] {
+            BitWriter writer(compressed.words.get(), 0);
+            encodeSymbols(from, to, table, writer);
+            writer.finish();
+        }, size, opt.reps);
+        printRow(csv, std::string("encode ") + ENCODE_ISA_NAMES[encodeIsa()], name, size, dispatched);
+
+        scalarEncode = dispatched;
+        if (encodeIsa() != ENCODE_SCALAR) {
+            scalarEncode = measure([&] {
+                BitWriter writer(compressed.words.get(), 0);
+                encodeSymbolsScalar(from, to, table, writer);
+                writer.finish();
+            }, size, opt.reps);
+            printRow(csv, "encode scalar", name, size, scalarEncode);
+        }
+    }
+
+    /* Packing alone, without the table lookups: the codes of the first symbols of the buffer
+        are taken in turn from an array small enough to stay in cache, so that only the
+        packed stream moves through the memory hierarchy. The codes are put one by one as in
+        the scalar encoder, which this bounds from above */
+    if (wanted(opt, "bitpack")) {
+        std::vector<Code> codes;
+        for (const char* p = from; p < to && codes.size() < 4096; ++p)
+            codes.push_back(table[static_cast<unsigned char>(*p)]);
+
+        uint64_t cycleBits = 0, packedBits = 0;
+        for (uint64_t k = 0; k < codes.size(); ++k) {
+            cycleBits += codes[k].len;
+            if (k < size % codes.size())
+                packedBits += codes[k].len;
+        }
+        packedBits += size / codes.size() * cycleBits;
+
+        BitBuffer packed;
+        packed.allocate(packedBits);
+
+        // Captured by value, so that the stores of the writer do not force reloads through the closure
+        const Code* cycle = codes.data();
+        const uint64_t cycleLength = codes.size();
+        uint64_t* words = packed.words.get();
+
+        Measure bitpack = measure([cycle, cycleLength, words, size] {
+            BitWriter writer(words, 0);
+            for (uint64_t left = size; left;) {
+                uint64_t n = std::min(left, cycleLength);
+#pragma GCC unroll 4
+                for (uint64_t k = 0; k < n; ++k)
+                    writer.put(cycle[k].bits, cycle[k].len);
+                left -= n;
+            }
+            writer.finish();
+        }, size, opt.reps);
+        printRow(csv, "bitpack", name, size, bitpack);
+
+        if (scalarEncode.ns && bitpack.ns > scalarEncode.ns)
+            std::cerr << "Packing the " << name << " buffer is slower than encoding it with the scalar loop, "
+                "its figures are not an upper bound" << std::endl;
+    }
+
+    if (wanted(opt, "decode")) {
+        // A compressed stream matching the buffer, whatever the kernels run before wrote
+        BitWriter writer(compressed.words.get(), 0);
+        encodeSymbols(from, to, table, writer);
+        writer.finish();
+
+        DecodeTable decodeTable(table);
+        std::string decompressed(size, '\0');
+
+        printRow(csv, "decode", name, size, measure([&] {
+            BitReader reader(compressed.bytes(), compressed.byteSize(), 0);
+            decodeSymbols(decodeTable, reader, decompressed.data(), size);
+        }, size, opt.reps));
+
+        if (decompressed != text)
+            std::cerr << "Decoding of the " << name << " buffer does not match its input" << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+
+    int o;
+    while ((o = getopt(argc, argv, "s:S:r:k:c:")) != -1) {
+        switch (o) {
+        case 's':
+            opt.inCache = std::max(1, atoi(optarg)) * (1ull << 10);
+            break;
+        case 'S':
+            opt.outOfCache = std::max(1, atoi(optarg)) * (1ull << 20);
+            break;
+        case 'r':
+            opt.reps = std::max(1, atoi(optarg));
+            break;
+        case 'k':
+            opt.kernels = split(optarg);
+            break;
+        case 'c':
+            opt.csv = optarg;
+            break;
+        default:
+            std::cout << "Usage: " << argv[0] << " [-s in-cache KiB] [-S out-of-cache MiB] [-r repetitions] "
+                "[-k histogram,codes,encode,bitpack,decode] [-c results.csv] [input]" << std::endl;
+            return 1;
+        }
+    }
+
+    if (optind < argc)
+        opt.input = argv[optind];
+
+    std::ofstream csvFile;
+    std::ostream* csv = nullptr;
+    if (!opt.csv.empty()) {
+        csvFile.open(opt.csv);
+        if (!csvFile.is_open()) {
+            std::cerr << "Could not open " << opt.csv << std::endl;
+            return 1;
+        }
+        csvFile << "kernel,buffer,bytes,ns,gb_per_s,bytes_per_cycle\n" << std::fixed << std::setprecision(3);
+        csv = &csvFile;
+    }
+
+    std::cout << std::left << std::setw(16) << "kernel" << std::setw(14) << "buffer" << std::right
+        << std::setw(12) << "bytes" << std::setw(14) << "ns" << std::setw(10) << "GB/s";
+#ifdef HAVE_TSC
+    std::cout << std::setw(12) << "bytes/cycle";
+#endif
+    std::cout << std::endl;
+
+    // Histogram and code table of a whole buffer, as built once per file by the programs
+    if (wanted(opt, "codes")) {
+        std::string text = makeBuffer(opt.input, opt.inCache);
+        Histogram histogram{};
+        countSymbols(text.data(), text.data() + text.size(), histogram);
+
+        printRow(csv, "codes", "-", 0, measure([&] {
+            CodeTable table = buildCodes(histogram);
+            DecodeTable decodeTable(table);
+            asm volatile("" : : "r"(decodeTable.entries.data()) : "memory");
+        }, 0, opt.reps));
+    }
+
+    runBuffer(opt, "in-cache", opt.inCache, csv);
+    runBuffer(opt, "out-of-cache", opt.outOfCache, csv);
+
+    return 0;
+}
@@ -1,49 +1,116 @@
 #include <iostream>
 #include <vector>
+#include <map>
 #include <stdlib.h>
 #include <string>
-#include <unordered_map>
-#include <queue>
-#include <filesystem>
-#include <mutex>
 #include <stdio.h>
+#include <mutex>
+#include <condition_variable>
 
 #include "utimer.hpp"
+#include "args.hpp"
+#include "report.hpp"
 
 #include "Tasks.hpp"
+#include "decoder.hpp"
+#include "stream.hpp"
+#include "numa.hpp"
+#include "trace.hpp"
+#include "perf.hpp"
+#include "metrics.hpp"
 
 #include <ff/ff.hpp>
 
 bool verify;
+std::unique_ptr<Topology> topology; // Only in topology-aware mode
 
-class ReadEmitter : public ff::ff_monode_t<FRTASK> {
-private:
-    char* filename;
-    int fileSize;
+/* First action of every farm worker: naming its thread in the trace and, in topology-aware
+    mode, pinning itself to a CPU of its node */
+int pinWorker([[maybe_unused]] const char* name, const int i) {
+    TRACE_THREAD(name, i)
+    if (topology && !topology->pin(i))
+        std::cerr << "Could not pin worker " << i << std::endl;
+
+    return 0;
+}
+
+// Adds a task to the stats of worker i, as a remote one if in topology-aware mode the pages at 'data' are on another node
+void account(WorkerStats& s, const long elapsed, const int i, const void* data) {
+    s.busy += elapsed;
+    ++s.tasks;
+    metricsBusy(i, elapsed);
+
+    if (topology && pageNodes({data})[0] != topology->nodeOf(i)) {
+        s.remoteBusy += elapsed;
+        ++s.remote;
+    }
+}
+
+/* Workers the chunks are sent to in topology-aware mode: the workers of the node holding
+    the pages of a chunk take it in turns, while a chunk of unknown node goes to the worker
+    of the even split */
+class NodeDealer {
+    std::vector<std::vector<int>> workers; // By node
+    std::vector<size_t> turns;
     int nw;
-    std::vector<std::unordered_map<char, unsigned>>* maps;
-    std::vector<std::vector<std::pair<char, unsigned>>>* mapReds;
-    std::vector<std::string>* stringReds;
-    std::vector<std::mutex>* mutexes;
+
 public:
-    ReadEmitter(
-        char* filename, 
-        int fileSize, 
-        int nw
-    ) : filename(filename), 
-        fileSize(fileSize), 
-        nw(nw)
-    {
-        maps = new std::vector<std::unordered_map<char, unsigned>>(nw);
-        mapReds = new std::vector<std::vector<std::pair<char, unsigned>>>(nw);
-        stringReds = new std::vector<std::string>(nw);
-        mutexes = new std::vector<std::mutex>(nw);
+    explicit NodeDealer(const int nw) : nw(nw) {
+        for (int i = 0; i < nw; ++i) {
+            int node = topology->nodeOf(i);
+            if (static_cast<int>(workers.size()) <= node)
+                workers.resize(node + 1);
+            workers[node].push_back(i);
+        }
+        turns.resize(workers.size());
     }
 
+    int next(const int node, const uint64_t c, const uint64_t n) {
+        if (node < 0 || node >= static_cast<int>(workers.size()) || workers[node].empty())
+            return c * nw / n;
+
+        return workers[node][turns[node]++ % workers[node].size()];
+    }
+};
+
+// Node of the page holding the first of the bytes at every offset of 'data'
+std::vector<int> offsetNodes(const char* data, const std::vector<uint64_t>& offsets) {
+    std::vector<const void*> addresses;
+    for (uint64_t offset : offsets)
+        addresses.push_back(data + offset);
+
+    return pageNodes(addresses);
+}
+
+class ReadEmitter : public ff::ff_monode_t<FRTASK> {
+private:
+    std::string_view* text;
+    LoadedFile* loaded;
+    uint64_t nChunks;
+    std::vector<Histogram>* maps;
+public:
+    ReadEmitter(
+        std::string_view* text, 
+        LoadedFile* loaded,
+        uint64_t nChunks,
+        std::vector<Histogram>* maps
+    ) : text(text), 
+        loaded(loaded),
+        nChunks(nChunks),
+        maps(maps)
+    {}
+
+    /* Many more chunks than workers, handed out on demand; in topology-aware mode each
+        worker loads and counts its even share, so that it first touches its pages */
     FRTASK* svc(FRTASK*) {
-        for (int i = 0; i < nw; ++i) {
-            auto t = new FRTASK(filename, fileSize, nw, i, maps, mapReds, stringReds, mutexes);
-            ff_send_out(t);
+        TRACE_SPAN("ReadEmitter")
+        metricsPhase("counting");
+        for (uint64_t c = 0; c < nChunks; ++c) {
+            auto t = new FRTASK(text, loaded, nChunks, c, maps);
+            if (topology)
+                ff_send_out_to(t, c * get_num_outchannels() / nChunks);
+            else
+                ff_send_out(t);
         }
 
         return EOS;
@@ -51,640 +118,1021 @@ public:
 };
 
 class ReadWorker : public ff::ff_node_t<FRTASK> {
-    FRTASK* taskPtr;
-
-    FRTASK* svc(FRTASK* t) {
-        std::fstream file;
-        file.open(t->filename);
+    HistogramTree* tree;
+    std::vector<long>* countTimes;
+    std::vector<WorkerStats>* stats;
+    std::atomic<bool>* loadFailed;
+    Histogram sum; // Of the chunks counted by this worker
 
-        int delta = t->fileSize / t->nw;
-        int from = t->i * delta;
-        int to = t->i == t->nw - 1 ? t->fileSize : from + delta;
-
-        file.seekg(from, std::ios::beg);
+public:
+    ReadWorker(
+        HistogramTree* tree, 
+        std::vector<long>* countTimes, 
+        std::vector<WorkerStats>* stats,
+        std::atomic<bool>* loadFailed
+    ) : tree(tree), countTimes(countTimes), stats(stats), loadFailed(loadFailed), sum{} {}
 
-        std::string s;
-        s.reserve(delta);
+    int svc_init() { return pinWorker("ReadWorker", get_my_id()); }
 
-        char c;
-        int count = from;
-        while (count++ < to && file >> std::noskipws >> c) {
-            ++(*t->maps)[t->i][c];
-            s += c;
+    FRTASK* svc(FRTASK* t) {
+        TRACE_SPAN("ReadWorker")
+        auto [from, to] = chunkBytes(t->text->size(), t->c, t->n);
+
+        START(count)
+        if (t->loaded) {
+            TRACE_SPAN("read")
+            PerfPhase perf("read");
+            if (!t->loaded->load(from, to))
+                *loadFailed = true;
         }
-        (*t->stringReds)[t->i] = std::move(s);
-
-        file.close();
 
-        for (const auto& pair : (*t->maps)[t->i]) {
-            auto pairHash = std::hash<char>{}(pair.first) % t->nw;
-            std::unique_lock ul((*t->mutexes)[pairHash]);
-            (*t->mapReds)[pairHash].push_back(pair);
+        {
+            TRACE_SPAN("histogram")
+            PerfPhase perf("histogram");
+            countSymbols(t->text->data() + from, t->text->data() + to, (*t->maps)[t->c]);
+            addHistogram(sum, (*t->maps)[t->c]);
         }
+        metricsAdd(BYTES_READ, to - from);
+        STOP(count, elapsed)
 
-        taskPtr = t;
+        account((*stats)[get_my_id()], elapsed, get_my_id(), t->text->data() + from);
 
-        return GO_ON;
+        return t;
     }
 
+    // Every worker gets the EOS, hence all of them take part in the reduction
     void eosnotify(ssize_t) {
-        ff_send_out(taskPtr);
+        START(reduce)
+        tree->reduce(sum, get_my_id());
+        STOP(reduce, elapsed)
+        (*countTimes)[get_my_id()] = (*stats)[get_my_id()].busy + elapsed;
     }
 };
 
-class ReadCollector : public ff::ff_node_t<FRTASK> {
-    FRTASK* taskPtr;
+class ReadCollector : public ff::ff_node_t<FRTASK, PARCODETASK> {
+    std::string_view* text;
+    HistogramTree* tree;
+    std::vector<long>* countTimes;
+    std::vector<WorkerStats>* stats;
+    int nw;
     
     int notifications;
 
 public:
-    ReadCollector() : notifications(0) {}
+    ReadCollector(
+        std::string_view* text,
+        HistogramTree* tree, 
+        std::vector<long>* countTimes, 
+        std::vector<WorkerStats>* stats,
+        int nw
+    ) : text(text), tree(tree), countTimes(countTimes), stats(stats), nw(nw), notifications(0) {}
     
-    FRTASK* svc(FRTASK* t) {
-        if (!notifications) taskPtr = t;
+    PARCODETASK* svc(FRTASK* t) {
+        TRACE_SPAN("ReadCollector")
+        delete t;
 
         return GO_ON;
     }
 
     void eosnotify(ssize_t) {
-        if (++notifications == taskPtr->nw) {
-            delete taskPtr->maps;
-            delete taskPtr->mutexes;
+        if (++notifications == nw) { // Works as a barrier
+            printWorkerStats("Counting", *stats, false, topology != nullptr);
+
+            // Histograms are reduced while counting, hence the slowest worker bounds the whole phase
+            long countTime = *std::max_element(countTimes->begin(), countTimes->end());
+            reportPhase("counting", countTime);
+            std::cout << "Histogram: " << static_cast<double>(text->size()) / std::max(1L, countTime) / 1000 << " GB/s" << std::endl;
+
+            std::vector<char>* symbols = new std::vector<char>;
+            std::vector<uint64_t>* freqs = new std::vector<uint64_t>;
+            populateSymbolsAndFrequencies(tree->total(), *symbols, *freqs);
 
-            ff_send_out(taskPtr);
+            ff_send_out(new PARCODETASK(symbols, freqs, nw));
         }
     }
 };
 
-class PairsEmitter : public ff::ff_monode_t<FRTASK, REDTASK> {
-    std::vector<std::vector<std::pair<char, unsigned>>>* mapReds;
-    std::vector<std::string>* stringReds;
-    int nw;
+class CodesGeneration : public ff::ff_node_t<PARCODETASK, CODESTASK> {
+    CodeLengths* lengths;
+    unsigned maxLen;
 public:
-    REDTASK* svc(FRTASK* t) {
-        mapReds = t->mapReds;
-        nw = t->nw;
-        stringReds = t->stringReds;
+    CodesGeneration(CodeLengths* lengths, unsigned maxLen) : lengths(lengths), maxLen(maxLen) {}
+
+    CODESTASK* svc(PARCODETASK* t) {
+        TRACE_SPAN("CodesGeneration")
+        metricsPhase("codes");
+        long codesTime;
+        {
+            utimer timer("Code lengths generation ", &codesTime);
+            TRACE_SPAN("tree")
+            PerfPhase perf("tree");
+
+            *lengths = huffmanCodeLengths(*t->symbols, *t->freqs);
+
+            if (maxCodeLength(*lengths) > maxLen)
+                *lengths = packageMerge(*t->symbols, *t->freqs, maxLen);
+        }
+        reportPhase("codes", codesTime);
 
+        ff_send_out(new CODESTASK(lengths, t->nw));
+
+        delete t->symbols;
+        delete t->freqs;
         delete t;
 
-        std::vector<std::unordered_map<char, unsigned>>* outReducedMaps = new std::vector<std::unordered_map<char, unsigned>>(nw);
-        for (int i = 0; i < nw; ++i) {
-            auto t = new REDTASK(mapReds, stringReds, outReducedMaps, i, nw);
-            ff_send_out(t);
-        }
-        
         return EOS;
     }
 };
 
-class PairsReducerWorker : public ff::ff_node_t<REDTASK> {
-    REDTASK* taskPtr;
-
-    REDTASK* svc(REDTASK* t) {
-        for (const auto& [key, value] : (*t->mapReds)[t->i]) 
-            (*t->outReducedMaps)[t->i][key] += value;
+class CompressionEmitter : public ff::ff_monode_t<CODESTASK, COMPRESSIONTASK> {
+    std::string_view* text;
+    CodeTable* codeTable;
+    BitBuffer* compressed;
+    std::vector<Histogram>* maps;
+    
+public:
+    CompressionEmitter(
+        std::string_view* text,
+        CodeTable* codeTable,
+        BitBuffer* compressed,
+        std::vector<Histogram>* maps
+    ) : text(text), codeTable(codeTable), compressed(compressed), maps(maps) {}
 
-        taskPtr = t;
+    COMPRESSIONTASK* svc(CODESTASK* t) {
+        TRACE_SPAN("CompressionEmitter")
+        metricsPhase("encoding");
+        *codeTable = canonicalCodes(*t->lengths);
         
-        return GO_ON;
-    }
+        delete t;
 
-    void eosnotify(ssize_t) {
-        ff_send_out(taskPtr);
+        /* The chunks read by the ReadWorkers are the same ones encoded by the CompressionWorkers, 
+            hence their histograms give the exact starting bit of each chunk in the output */
+        uint64_t n = maps->size();
+        std::vector<uint64_t>* bitOffsets = new std::vector<uint64_t>(n + 1, 0);
+        for (uint64_t c = 0; c < n; ++c)
+            (*bitOffsets)[c + 1] = (*bitOffsets)[c] + encodedBits((*maps)[c], *codeTable);
+
+        compressed->allocate((*bitOffsets)[n]);
+
+        std::vector<BitTail>* tails = new std::vector<BitTail>(n);
+        std::vector<BlockEntry>* blocks = new std::vector<BlockEntry>(blockCount(text->size()));
+
+        // In topology-aware mode every chunk goes to a worker of the node where it was loaded
+        std::vector<int> nodes(n, -1);
+        if (topology) {
+            std::vector<const void*> starts;
+            for (uint64_t c = 0; c < n; ++c)
+                starts.push_back(text->data() + chunkBytes(text->size(), c, n).first);
+            nodes = pageNodes(starts);
+        }
+        std::unique_ptr<NodeDealer> dealer(topology ? new NodeDealer(get_num_outchannels()) : nullptr);
+
+        for (uint64_t c = 0; c < n; ++c) {
+            auto t = new COMPRESSIONTASK(
+                text,
+                codeTable,
+                compressed,
+                bitOffsets,
+                tails,
+                blocks,
+                n,
+                c
+            );
+            if (dealer)
+                ff_send_out_to(t, dealer->next(nodes[c], c, n));
+            else
+                ff_send_out(t);
+        }
+
+        return EOS;
     }
 };
 
-class PairsCollector : public ff::ff_node_t<REDTASK> {
-    std::unordered_map<char, unsigned>* res;
-    std::string* text;
-    std::vector<std::string>* stringReds;
-    std::vector<std::unordered_map<char, unsigned>>* outReducedMaps;
-    int nw;
+class CompressionWorker : public ff::ff_node_t<COMPRESSIONTASK> {
+    std::vector<WorkerStats>* stats;
 
-    int notifications;
 public:
-    PairsCollector(std::string* text) : text(text), notifications(0) 
-    {
-        res = new std::unordered_map<char, unsigned>;
-    }
+    CompressionWorker(std::vector<WorkerStats>* stats) : stats(stats) {}
 
-    REDTASK* svc(REDTASK* t) {
-        if (!notifications) { // Assign just once
-            stringReds = t->stringReds;
-            nw = t->nw;
-            outReducedMaps = t->outReducedMaps;
-        }
+    int svc_init() { return pinWorker("CompressionWorker", get_my_id()); }
 
-        delete t;
+    COMPRESSIONTASK* svc(COMPRESSIONTASK* t) {
+        TRACE_SPAN("CompressionWorker")
+        auto [from, to] = chunkBytes(t->text->size(), t->c, t->n);
+
+        START(encode)
+        {
+            TRACE_SPAN("encode")
+            PerfPhase perf("encode");
+            BitWriter writer(t->compressed->words.get(), (*t->bitOffsets)[t->c]);
+            encodeBlocks(t->text->data(), from, to, *t->codeTable, writer, t->compressed->words.get(), *t->blocks);
         
-        return GO_ON;
+            (*t->tails)[t->c] = writer.tail();
+        }
+        metricsAdd(BYTES_ENCODED, to - from);
+        STOP(encode, elapsed)
+
+        account((*stats)[get_my_id()], elapsed, get_my_id(), t->text->data() + from);
+
+        return t;
     }
+};
 
-    void eosnotify(ssize_t) {
-        if (++notifications == nw) { // Works as a barrier
-            for (int i = 0; i < nw; ++i) {
-                for (const auto& [key, value] : (*outReducedMaps)[i]) 
-                    (*res)[key] += value;
-                *text += (*stringReds)[i];
-            }
+/* Collector of the compression farm, the last stage of the pipeline: the workers deliver
+    the encoded chunks as they are done, and a chunk arriving early waits for the ones before it. Once a chunk is next in
+    input order, all the previous ones are done: the word it shares with the previous chunk
+    is completed and every byte before its own tail is appended to the file, while the
+    following chunks are still being encoded */
+class ChunkWriter : public ff::ff_node_t<COMPRESSIONTASK> {
+    std::string fn; // Empty when verifying, as nothing is written
+    bool indexed;
+    BitBuffer* compressed;
+    std::vector<WorkerStats>* stats;
+
+    OutputFile out;
+    uint64_t headerSize;
+    uint64_t written; // Payload bytes stored so far
+    long writeTime;
+    std::map<uint64_t, COMPRESSIONTASK*> pending; // Chunks arrived before the next one, by index
+    uint64_t next;
+
+    /* The block index is complete only once the last chunk is encoded, but its size is known
+        from the start: until then the workers are still filling it, hence it is not read */
+    ContainerHeader header(COMPRESSIONTASK* t, const bool complete) {
+        ContainerHeader h;
+        h.originalLength = t->text->size();
+        h.totalBits = (*t->bitOffsets)[t->n];
+        h.codeTable = *t->codeTable;
+        if (!indexed)
+            return h;
+
+        if (complete)
+            h.blocks = *t->blocks;
+        else
+            h.blocks.resize(blockCount(h.originalLength));
+
+        return h;
+    }
 
-            std::vector<char>* symbols = new std::vector<char>;
-            std::vector<unsigned>* freqs = new std::vector<unsigned>;
+    void finish(COMPRESSIONTASK* t) {
+        printWorkerStats("Encoding", *stats, false, topology != nullptr);
+
+        if (!fn.empty()) {
+            std::string headerBytes = serializeHeader(header(t, true));
+            out.write(headerBytes.data(), headerBytes.size(), 0);
 
-            START(symbolsAndFreqs)
+            std::cout << "Writing: " << writeTime << " usecs" << std::endl;
+            reportPhase("writing", writeTime);
+        }
 
-            symbols->reserve(res->size());
-            freqs->reserve(res->size());
+        ok = fn.empty() || out.good();
 
-            for (const auto& [sym, freq] : *res) {
-                symbols->push_back(sym);
-                freqs->push_back(freq);
-            }
+        delete t->bitOffsets;
+        delete t->tails;
+        delete t->blocks;
+        delete t;
+    }
 
-            STOP(symbolsAndFreqs, time)
+    void store(COMPRESSIONTASK* t) {
+        bool last = t->c + 1 == t->n;
 
-            std::cout << "Time needed for computing symbols and frequencies vectors: " << time << " usecs" << std::endl;
+        if (t->c == 0 && !fn.empty()) {
+            headerSize = serializeHeader(header(t, false)).size();
+            out.create(fn, headerSize + compressed->byteSize());
+        }
 
-            ff_send_out(new PARCODETASK(symbols, freqs, nw));
+        if (t->c > 0)
+            mergeTail((*t->tails)[t->c - 1]);
+        if (last)
+            mergeTail((*t->tails)[t->c]);
+
+        // The word holding the first bit of the next chunk is still incomplete
+        uint64_t complete = last ? compressed->byteSize() : (*t->bitOffsets)[t->c + 1] / 64 * 8;
+
+        if (out.good() && complete > written) {
+            TRACE_SPAN("write")
+            PerfPhase perf("write");
+            START(write)
+            out.write(compressed->bytes() + written, complete - written, headerSize + written);
+            STOP(write, elapsed)
+            writeTime += elapsed;
+            metricsAdd(BYTES_WRITTEN, complete - written);
         }
-    }
+        written = complete;
 
-    void svc_end() {
-        delete outReducedMaps;
-        delete res;
+        if (last)
+            finish(t);
+        else
+            delete t;
     }
-};
 
-class CodesGenerationEmitter : public ff::ff_monode_t<PARCODETASK, CODESTASK> {
-    std::vector<char>* symbols;
-    std::vector<unsigned>* freqs;
-    std::unordered_map<char, std::string>* charCodeMap;
-    int nw;
 public:
-    CodesGenerationEmitter(std::unordered_map<char, std::string>* charCodeMap) : charCodeMap(charCodeMap) {}
+    bool ok;
 
-    CODESTASK* svc(PARCODETASK* t) {
-        symbols = t->symbols;
-        freqs = t->freqs;
-        nw = t->nw;
+    ChunkWriter(
+        const std::string& fn, 
+        const bool indexed,
+        BitBuffer* compressed, 
+        std::vector<WorkerStats>* stats
+    ) : fn(fn), indexed(indexed), compressed(compressed), stats(stats), headerSize(0), written(0), writeTime(0), next(0), ok(false) {}
 
-        delete t;
-
-        std::priority_queue<std::shared_ptr<Node>, std::vector<std::shared_ptr<Node>>, cmp>* q = 
-            new std::priority_queue<std::shared_ptr<Node>, std::vector<std::shared_ptr<Node>>, cmp>;
-        std::mutex* queueMutex = new std::mutex;
+    COMPRESSIONTASK* svc(COMPRESSIONTASK* t) {
+        TRACE_SPAN("ChunkWriter")
+        pending[t->c] = t;
 
-        for (int i = 0; i < nw; ++i) {
-            auto t = new CODESTASK(
-                symbols,
-                freqs,
-                queueMutex,
-                q,
-                charCodeMap,
-                nw,
-                i
-            );
-            ff_send_out(t);
+        for (auto it = pending.find(next); it != pending.end(); it = pending.find(++next)) {
+            COMPRESSIONTASK* chunk = it->second;
+            pending.erase(it);
+            store(chunk);
         }
-        
-        return EOS;
+
+        return GO_ON;
     }
 };
 
-class CodesGenerationWorker : public ff::ff_node_t<CODESTASK> {
-    CODESTASK* taskPtr;
+/* Segments of the input in flight in the streaming pipeline, allocated once: the reader
+    blocks until the writer gives one back, which bounds the memory in use */
+class SegmentPool {
+    std::vector<std::unique_ptr<Segment>> segments;
+    std::vector<Segment*> free;
+    std::mutex m;
+    std::condition_variable available;
+    bool failed;
 
-    CODESTASK* svc(CODESTASK* t) {
-        int delta = (*t->symbols).size() / t->nw;
-        int from = t->i * delta;
-        int to = t->i == t->nw - 1 ? (*t->symbols).size() : from + delta;
-        
-        for (int j = from; j < to; ++j) {
-            (*t->queueMutex).lock();
-            (*t->q).push(std::make_shared<Node>((*t->symbols)[j], (*t->freqs)[j]));
-            (*t->queueMutex).unlock();
+public:
+    const uint64_t segment;
+
+    SegmentPool(const unsigned inFlight, const uint64_t segment) : failed(false), segment(segment) {
+        for (unsigned i = 0; i < inFlight; ++i) {
+            segments.push_back(std::make_unique<Segment>());
+            segments.back()->data.reset(new char[segment]);
+            free.push_back(segments.back().get());
         }
+    }
 
-        taskPtr = t;
+    // Null once the pipeline failed
+    Segment* get() {
+        std::unique_lock ul(m);
+        available.wait(ul, [&] { return failed || !free.empty(); });
+        if (failed)
+            return nullptr;
 
-        return GO_ON;
+        Segment* s = free.back();
+        free.pop_back();
+        return s;
     }
 
-    void eosnotify(ssize_t) {
-        ff_send_out(taskPtr);
+    void put(Segment* s) {
+        std::unique_lock ul(m);
+        free.push_back(s);
+        available.notify_one();
     }
-};
 
-class CodesGenerationCollector : public ff::ff_node_t<CODESTASK> {
-    CODESTASK* taskPtr;
+    void fail() {
+        std::unique_lock ul(m);
+        failed = true;
+        available.notify_all();
+    }
+};
 
-    int notifications;
+// Source of the streaming pipeline, cutting the input in segments
+class SegmentReader : public ff::ff_node_t<Segment> {
+    int inFd;
+    SegmentPool* pool;
 
-    void generateCodes(
-        const std::shared_ptr<Node> root,
-        const std::string currCode, 
-        std::unordered_map<char, std::string>& charCodeMap
-    ) {
-        if (!root)
-            return;
-        
-        if (root->data != '$')
-            if (!charCodeMap.contains(root->data))
-                charCodeMap[root->data] = currCode;
-        
-        generateCodes(root->left, currCode + "0", charCodeMap);
-        generateCodes(root->right, currCode + "1", charCodeMap);    
-    }
+public:
+    bool ok;
 
-    std::shared_ptr<Node> treeGen(
-        std::priority_queue<std::shared_ptr<Node>, std::vector<std::shared_ptr<Node>>, cmp>& q
-    ) {
-        std::shared_ptr<Node> left, right, top;
-        while (q.size() > 1) {
-            left = q.top();
-            q.pop();
+    SegmentReader(int inFd, SegmentPool* pool) : inFd(inFd), pool(pool), ok(true) {}
 
-            right = q.top();
-            q.pop();
+    Segment* svc(Segment*) {
+        TRACE_SPAN("SegmentReader")
+        while (Segment* s = pool->get()) {
+            int64_t n = readFull(inFd, s->data.get(), pool->segment);
+            if (n < 0) {
+                std::cerr << "Could not read the input" << std::endl;
+                ok = false;
+            }
 
-            top = std::make_shared<Node>('$', left->freq + right->freq);
+            if (n <= 0) {
+                pool->put(s);
+                break;
+            }
 
-            top->left = left;
-            top->right = right;
+            s->size = n;
+            metricsAdd(BYTES_READ, n);
+            ff_send_out(s);
 
-            q.push(top);
+            if (static_cast<uint64_t>(n) < pool->segment)
+                break;
         }
 
-        return q.top();
+        return EOS;
     }
+};
+
+class SegmentCompressor : public ff::ff_node_t<Segment> {
+    unsigned maxLen;
+
 public:
-    CodesGenerationCollector() : notifications(0) {}
+    SegmentCompressor(unsigned maxLen) : maxLen(maxLen) {}
 
-    CODESTASK* svc(CODESTASK* t) {
-        if (!notifications) taskPtr = t; // Assign once
-        
-        return GO_ON;
-    }
+    int svc_init() { return pinWorker("SegmentCompressor", get_my_id()); }
 
-    void eosnotify(ssize_t) {
-        if (++notifications == taskPtr->nw) {
-            utimer t("Tree and codes generation ");
+    Segment* svc(Segment* s) {
+        TRACE_SPAN("SegmentCompressor")
+        compressSegment(*s, maxLen);
+        metricsAdd(BYTES_ENCODED, s->size);
 
-            std::shared_ptr<Node> root = treeGen(*taskPtr->q);
+        return s;
+    }
+};
+
+// Appends the frames in input order, as delivered by the ordered farm
+class FrameWriter : public ff::ff_node_t<Segment> {
+    int outFd;
+    SegmentPool* pool;
 
-            generateCodes(root, "", *taskPtr->charCodeMap);
-            ff_send_out(taskPtr);
+public:
+    bool ok;
+    uint64_t frames;
+
+    FrameWriter(int outFd, SegmentPool* pool) : outFd(outFd), pool(pool), ok(true), frames(0) {}
+
+    Segment* svc(Segment* s) {
+        TRACE_SPAN("FrameWriter")
+        if (!writeFull(outFd, s->header.data(), s->header.size()) ||
+            !writeFull(outFd, s->compressed.bytes(), s->compressed.byteSize())) {
+            std::cerr << "Could not write the output" << std::endl;
+            ok = false;
+            pool->fail(); // Stops the reader
         }
-    }
 
-    void svc_end() {
-        delete taskPtr->queueMutex;
-        delete taskPtr->q;
-        delete taskPtr->freqs;
-        delete taskPtr->symbols;
-        // delete taskPtr;
+        ++frames;
+        metricsAdd(BYTES_WRITTEN, s->header.size() + s->compressed.byteSize());
+        pool->put(s);
+
+        return GO_ON;
     }
 };
 
-class CompressionEmitter : public ff::ff_node_t<CODESTASK, COMPRESSIONTASK> {
-    std::string* text;
-    std::unordered_map<char, std::string>* charCodeMap;
-    std::string* compressedText;
-    int avgCodeLen;
-    int nw;
+std::string decompressStringSequential(
+    const BitBuffer& compressed, 
+    const CodeTable& codeTable,
+    const uint64_t fileSize
+) {
+    DecodeTable decodeTable(codeTable);
+
+    std::string decompressedString(fileSize, '\0');
     
-public:
-    CompressionEmitter(
-        std::string* text,
-        std::string* compressedText
-    ) : text(text), compressedText(compressedText) {}
+    BitReader reader(compressed.bytes(), compressed.byteSize(), 0);
+    decodeSymbols(decodeTable, reader, decompressedString.data(), fileSize);
 
-    COMPRESSIONTASK* svc(CODESTASK* t) {
-        charCodeMap = t->charCodeMap;
-        nw = t->nw;
-        
-        // delete t;
+    return decompressedString;
+}
 
-        int sumSize = 0;
-        for (const auto& [_, v] : *charCodeMap)
-            sumSize += v.size();
+// Workers of a farm, all constructed with the same arguments
+template<typename T, typename... Args>
+std::vector<std::unique_ptr<ff::ff_node>> createWorkers(int nw, Args... args) {
+    // utimer t("Time spent creating workers ");
+    std::vector<std::unique_ptr<ff::ff_node>> workers;
+    for (int i = 0; i < nw; ++i)
+        workers.push_back(std::make_unique<T>(args...));
+    return workers;
+}
 
-        // Needed for reserving approx space for string during compression and decompression 
-        avgCodeLen = sumSize / charCodeMap->size();        
+// Deals every worker its even share of the compressed file, so that its pages are first touched on the node of the worker
+class LoadEmitter : public ff::ff_monode_t<LOADTASK> {
+    LoadedFile* loaded;
 
-        std::vector<std::string>* compressedResults = new std::vector<std::string>(nw);
-        for (int i = 0; i < nw; ++i) {
-            auto t = new COMPRESSIONTASK(
-                text,
-                charCodeMap,
-                compressedResults,
-                compressedText,
-                avgCodeLen,
-                nw,
-                i
-            );
-            ff_send_out(t);
-        }
+public:
+    LoadEmitter(LoadedFile* loaded) : loaded(loaded) {}
+
+    LOADTASK* svc(LOADTASK*) {
+        TRACE_SPAN("LoadEmitter")
+        uint64_t n = get_num_outchannels();
+        for (uint64_t c = 0; c < n; ++c)
+            ff_send_out_to(new LOADTASK(loaded, n, c), c);
 
         return EOS;
     }
 };
 
-class CompressionWorker : public ff::ff_node_t<COMPRESSIONTASK> {
-    COMPRESSIONTASK* taskPtr;
+class LoadWorker : public ff::ff_node_t<LOADTASK> {
+    std::atomic<bool>* loadFailed;
 
-    COMPRESSIONTASK* svc(COMPRESSIONTASK* t) {
-        int delta = (*t->text).size() / t->nw;
-        int from = t->i * delta;
-        int to = t->i == t->nw - 1 ? (*t->text).size() : from + delta;
+public:
+    LoadWorker(std::atomic<bool>* loadFailed) : loadFailed(loadFailed) {}
 
-        std::string localS;
-        localS.reserve(delta * t->avgCodeLen);
+    int svc_init() { return pinWorker("LoadWorker", get_my_id()); }
 
-        for (int j = from; j < to; ++j)
-            localS += (*t->charCodeMap)[(*t->text)[j]];
-        
-        (*t->compressedResults)[t->i] = std::move(localS);
-        
-        taskPtr = t;
+    LOADTASK* svc(LOADTASK* t) {
+        TRACE_SPAN("LoadWorker")
+        auto [from, to] = chunkBytes(t->loaded->view().size(), t->c, t->n);
+        if (!t->loaded->load(from, to))
+            *loadFailed = true;
+
+        delete t;
 
         return GO_ON;
     }
+};
 
-    void eosnotify(ssize_t) {
-        ff_send_out(taskPtr);
+class DecompressionEmitter : public ff::ff_monode_t<DECOMPRESSIONTASK> {
+    OutputFile* out;
+    const char* payload;
+    ContainerHeader* header;
+    DecodeTable* decodeTable;
+    char* decompressed;
+    uint64_t nChunks;
+
+public:
+    DecompressionEmitter(
+        OutputFile* out,
+        const char* payload,
+        ContainerHeader* header,
+        DecodeTable* decodeTable,
+        char* decompressed,
+        uint64_t nChunks
+    ) : out(out), 
+        payload(payload), 
+        header(header), 
+        decodeTable(decodeTable), 
+        decompressed(decompressed), 
+        nChunks(nChunks) 
+    {}
+
+    DECOMPRESSIONTASK* svc(DECOMPRESSIONTASK*) {
+        TRACE_SPAN("DecompressionEmitter")
+        // In topology-aware mode every chunk goes to a worker of the node holding the start of its payload
+        std::vector<int> nodes(nChunks, -1);
+        if (topology) {
+            std::vector<uint64_t> starts;
+            for (uint64_t c = 0; c < nChunks; ++c)
+                starts.push_back(header->blocks[chunkUnits(header->blocks.size(), c, nChunks).first].bitOffset / 8);
+            nodes = offsetNodes(payload, starts);
+        }
+        std::unique_ptr<NodeDealer> dealer(topology ? new NodeDealer(get_num_outchannels()) : nullptr);
+
+        for (uint64_t c = 0; c < nChunks; ++c) {
+            auto t = new DECOMPRESSIONTASK(out, payload, header, decodeTable, decompressed, c, nChunks);
+            if (dealer)
+                ff_send_out_to(t, dealer->next(nodes[c], c, nChunks));
+            else
+                ff_send_out(t);
+        }
+
+        return EOS;
     }
 };
 
-class CompressionCollector : public ff::ff_node_t<COMPRESSIONTASK> {
-    COMPRESSIONTASK* taskPtr;
+class DecompressionWorker : public ff::ff_node_t<DECOMPRESSIONTASK> {
+    std::vector<WorkerStats>* stats;
 
-    int notifications;
 public:
-    CompressionCollector() : notifications(0) {}
+    DecompressionWorker(std::vector<WorkerStats>* stats) : stats(stats) {}
 
-    COMPRESSIONTASK* svc(COMPRESSIONTASK* t) {
-        if (!notifications) taskPtr = t;
+    int svc_init() { return pinWorker("DecompressionWorker", get_my_id()); }
 
-        return GO_ON;
-    }
+    DECOMPRESSIONTASK* svc(DECOMPRESSIONTASK* t) {
+        TRACE_SPAN("DecompressionWorker")
+        uint64_t nBlocks = t->header->blocks.size();
+        auto [first, last] = chunkUnits(nBlocks, t->c, t->n);
 
-    void eosnotify(ssize_t) {
-        if (++notifications == taskPtr->nw) {
-            int totSize = 0;
-            for (int i = 0; i < taskPtr->nw; ++i)
-                totSize += (*taskPtr->compressedResults)[i].size();
-            
-            (*taskPtr->compressedText).reserve(totSize);
+        START(decode)
+        if (first < last) {
+            {
+                TRACE_SPAN("decode")
+                PerfPhase perf("decode");
+                decodeBlocks(t->payload, *t->header, *t->decodeTable, t->decompressed, first, last);
+            }
 
-            for (int i = 0; i < taskPtr->nw; ++i) 
-                *taskPtr->compressedText += (*taskPtr->compressedResults)[i];
+            uint64_t from = t->header->blocks[first].byteOffset;
+            uint64_t to = last < nBlocks ? t->header->blocks[last].byteOffset : t->header->originalLength;
+            metricsAdd(BYTES_DECODED, to - from);
 
-            if (!verify)
-                ff_send_out(
-                    new PARFINAL(taskPtr->compressedText, taskPtr->charCodeMap, taskPtr->avgCodeLen, taskPtr->nw)
-                );
+            TRACE_SPAN("write")
+            PerfPhase perf("write");
+            t->out->write(t->decompressed + from, to - from, from);
+            metricsAdd(BYTES_WRITTEN, to - from);
         }
-    }
-
-    void svc_end() {
-        delete taskPtr->compressedResults;
-        delete taskPtr;
-    }
-};
+        STOP(decode, elapsed)
 
-class ToFileCompressionEmitter : public ff::ff_node_t<PARFINAL, TOFILETASK> {
-    std::string* fn;
-    std::string* compressedText;
-    std::vector<std::pair<int, int>>* textPositions;
-    std::vector<int>* filePositions;
-    int compressedFileSize;
-    int nw;
+        // The output pages are first touched here, hence only the payload may be remote
+        account((*stats)[get_my_id()], elapsed, get_my_id(), t->payload + (first < last ? t->header->blocks[first].bitOffset / 8 : 0));
 
-public:
-    ToFileCompressionEmitter(char* filename) {
-        fn = new std::string("compressed_" + std::string(filename));
+        return t;
     }
+};
 
-    TOFILETASK* svc(PARFINAL* t) {
-        compressedText = t->compressedText;
-        nw = t->nw;
-
+class DecompressionCollector : public ff::ff_node_t<DECOMPRESSIONTASK> {
+    DECOMPRESSIONTASK* svc(DECOMPRESSIONTASK* t) {
+        TRACE_SPAN("DecompressionCollector")
         delete t;
 
-        compressedFileSize = compressedText->size() / 8;
+        return GO_ON;
+    }
+};
 
-        FILE* tempFile = fopen(fn->c_str(), "w");
-        fseek(tempFile, compressedFileSize, SEEK_SET);
-        fputc('\0', tempFile);
-        fclose(tempFile);
+class SpeculativeEmitter : public ff::ff_monode_t<SPECULATIVETASK> {
+    OutputFile* out;
+    const char* payload;
+    ContainerHeader* header;
+    DecodeTable* decodeTable;
+    int nw;
 
-        textPositions = new std::vector<std::pair<int, int>>(nw);
-        filePositions = new std::vector<int>(nw);
-        int delta = compressedText->size() / nw;
-        delta += delta % 8 == 0 ? 0 : 8 - (delta % 8);
+public:
+    SpeculativeEmitter(
+        OutputFile* out,
+        const char* payload,
+        ContainerHeader* header,
+        DecodeTable* decodeTable,
+        int nw
+    ) : out(out), 
+        payload(payload), 
+        header(header), 
+        decodeTable(decodeTable), 
+        nw(nw) 
+    {}
+
+    SPECULATIVETASK* svc(SPECULATIVETASK*) {
+        TRACE_SPAN("SpeculativeEmitter")
+        // Even split of the payload, in bits
+        uint64_t payloadSize = (header->totalBits + 7) / 8;
+        uint64_t delta = payloadSize / nw;
+
+        auto bitPositions = new std::vector<std::pair<uint64_t, uint64_t>>(nw);
         for (int i = 0; i < nw; ++i) {
-            (*textPositions)[i].first = i * delta;
-            (*textPositions)[i].second = i == nw - 1 ? compressedText->size() : (i + 1) * delta;
-            (*filePositions)[i] = (*textPositions)[i].first / 8;
+            (*bitPositions)[i].first = i * delta * 8;
+            (*bitPositions)[i].second = i == nw - 1 ? header->totalBits : (i + 1) * delta * 8;
         }
 
+        // In topology-aware mode every chunk goes to a worker of the node holding the start of its bits
+        std::vector<int> nodes(nw, -1);
+        if (topology) {
+            std::vector<uint64_t> starts;
+            for (int i = 0; i < nw; ++i)
+                starts.push_back((*bitPositions)[i].first / 8);
+            nodes = offsetNodes(payload, starts);
+        }
+        std::unique_ptr<NodeDealer> dealer(topology ? new NodeDealer(get_num_outchannels()) : nullptr);
+
+        auto chunks = new std::vector<SpeculativeChunk>(nw);
         for (int i = 0; i < nw; ++i) {
-            auto t = new TOFILETASK(
-                fn, 
-                compressedText, 
-                textPositions, 
-                filePositions, 
-                compressedFileSize, 
-                i, 
-                nw
-            );
-            ff_send_out(t);
+            auto t = new SPECULATIVETASK(out, payload, header, decodeTable, bitPositions, chunks, i, nw);
+            if (dealer)
+                ff_send_out_to(t, dealer->next(nodes[i], i, nw));
+            else
+                ff_send_out(t);
         }
 
         return EOS;
     }
 };
 
-class ToFileCompressionWorker : public ff::ff_node_t<TOFILETASK> {
-    TOFILETASK* taskPtr;
+class SpeculativeWorker : public ff::ff_node_t<SPECULATIVETASK> {
+    int svc_init() { return pinWorker("SpeculativeWorker", get_my_id()); }
+
+    SPECULATIVETASK* svc(SPECULATIVETASK* t) {
+        TRACE_SPAN("SpeculativeWorker")
+        TRACE_SPAN("decode")
+        PerfPhase perf("decode");
+        const auto& [from, to] = (*t->bitPositions)[t->i];
+        decodeSpeculative(t->payload, t->header->totalBits, *t->decodeTable, from, to, (*t->chunks)[t->i]);
+        metricsAdd(BYTES_DECODED, (*t->chunks)[t->i].symbols.size());
 
-    TOFILETASK* svc(TOFILETASK* t) {
-        std::fstream file;
-        file.open(*t->filename);
+        return t;
+    }
+};
 
-        file.seekp((*t->filePositions)[t->i]);
+class SpeculativeCollector : public ff::ff_node_t<SPECULATIVETASK> {
+    SPECULATIVETASK* taskPtr;
 
-        uint8_t b = 0;
-        int len = 0;
-        for (int j = (*t->textPositions)[t->i].first; j < (*t->textPositions)[t->i].second; ++j) { 
-            if (len < 7) {
-                if ((*t->compressedText)[j] == '1') ++b;
-                b <<= 1;
-                ++len;
-            } else if (len == 7) {
-                if ((*t->compressedText)[j] == '1') ++b;
-                len = 0;
+    int received;
 
-                file << b;
-                b = 0;
-            }
-        }
-        if (t->i == t->nw - 1) {
-            for (int i = 0; i < 7 - len; ++i)
-                b <<= 1;
-            
-            file << b;
-        }
+public:
+    bool ok;
 
-        file.close();
+    SpeculativeCollector() : taskPtr(nullptr), received(0), ok(false) {}
 
-        taskPtr = t;
+    SPECULATIVETASK* svc(SPECULATIVETASK* t) {
+        TRACE_SPAN("SpeculativeCollector")
+        if (!taskPtr) taskPtr = t; // Keeps one task for the shared data
+        else delete t;
+
+        if (++received == taskPtr->nw)
+            stitch();
 
         return GO_ON;
     }
 
-    void eosnotify(ssize_t) {
-        ff_send_out(taskPtr);
-    }
-};
+    // Stitches the chunks at their sync points, once all of them are decoded
+    void stitch() {
+        auto& chunks = *taskPtr->chunks;
+        const ContainerHeader& header = *taskPtr->header;
+
+        uint64_t pos = 0, total = 0;
+        bool corrupted = false;
+        for (int i = 0; !corrupted && i < taskPtr->nw; ++i) {
+            TRACE_SPAN("stitch")
+            const auto& [from, to] = (*taskPtr->bitPositions)[i];
+            pos = stitchChunk(taskPtr->payload, header.totalBits, *taskPtr->decodeTable, pos, from, to, chunks[i]);
+            total += chunks[i].size();
+            corrupted = chunks[i].corrupted;
+
+            std::cout << "Worker " << i << (chunks[i].synced ? " synced after " : " did not sync, wasted ") 
+                << chunks[i].wastedBits << " bits" << std::endl;
+        }
 
-class ToFileCompressionCollector : public ff::ff_node_t<TOFILETASK> {
-    TOFILETASK* taskPtr;
+        ok = !corrupted && total == header.originalLength;
+        if (!ok) {
+            std::cerr << "Truncated or corrupted compressed file" << std::endl;
+            return;
+        }
 
-    int notifications;
+        TRACE_SPAN("write")
+        PerfPhase perf("write");
+        uint64_t offset = 0;
+        for (const auto& c : chunks) {
+            taskPtr->out->write(c.bridge.data(), c.bridge.size(), offset);
+            offset += c.bridge.size();
+            taskPtr->out->write(c.symbols.data() + c.validFrom, c.symbols.size() - c.validFrom, offset);
+            offset += c.symbols.size() - c.validFrom;
+        }
+        metricsAdd(BYTES_WRITTEN, offset);
 
-public:
-    ToFileCompressionCollector() : notifications(0) {}
+        ok = taskPtr->out->good();
+    }
 
-    TOFILETASK* svc(TOFILETASK* t) {
-        taskPtr = t;
+    void svc_end() {
+        if (!taskPtr)
+            return;
 
-        return EOS;
+        delete taskPtr->bitPositions;
+        delete taskPtr->chunks;
+        delete taskPtr;
+        taskPtr = nullptr;
     }
+};
 
-    void eosnotify(ssize_t) {
-        if (++notifications == taskPtr->nw) {
-            delete taskPtr->filename;
-            delete taskPtr->textPositions;
-            delete taskPtr->filePositions;
-            delete taskPtr;
+/* Decodes a file written by the compression pipeline, relying only on its header. In
+    topology-aware mode, the file is loaded by a farm of workers, each its even share,
+    and the chunks are dealt to the workers of the node holding the start of their payload */
+bool decompressFile(const std::string& filename, int nw) {
+    ContainerHeader header;
+    std::string contents;
+    LoadedFile loaded;
+    const char* payload;
+    uint64_t payloadOffset;
+
+    {
+        TRACE_SPAN("read")
+        PerfPhase perf("read");
+        if (topology) {
+            if (!loaded.open(filename))
+                return false;
+
+            std::atomic<bool> loadFailed(false);
+            LoadEmitter emitter(&loaded);
+            ff::ff_Farm<LOADTASK> loadFarm(std::move(createWorkers<LoadWorker>(nw, &loadFailed)));
+            loadFarm.add_emitter(emitter);
+            loadFarm.run_and_wait_end();
+
+            std::string_view file = loaded.view();
+            if (loadFailed || !parseContainer(file.data(), file.size(), header, payloadOffset))
+                return false;
+
+            payload = file.data() + payloadOffset;
+            metricsAdd(BYTES_READ, file.size());
+        } else {
+            if (!readContainer(filename, header, contents, payloadOffset))
+                return false;
+
+            payload = contents.data() + payloadOffset;
+            metricsAdd(BYTES_READ, contents.size());
         }
     }
-};
+    metricsPhase("decoding");
 
-std::string decompressStringSequential(
-    const std::string& compressedText, 
-    std::unordered_map<char, std::string>& charCodeMap,
-    const int fileSize
-) {
-    std::unordered_map<std::string, char> revCharCodeMap;
-    for (auto& [key, value] : charCodeMap) 
-        revCharCodeMap[value] = key;
+    DecodeTable decodeTable(header.codeTable);
 
-    std::string decompressedString;
-    decompressedString.reserve(fileSize);
-    
-    std::string s = "";
-    for (const char c : compressedText) {
-        s += c;
-        if (revCharCodeMap.contains(s)) {
-            decompressedString += revCharCodeMap[s];
-            s = "";
-        }
+    std::string fn = "decompressed_" + filename;
+
+    OutputFile out;
+    if (!out.create(fn, header.originalLength))
+        return false;
+
+    if (header.blocks.empty()) { // Index-free decoding, relying on self-synchronization
+        SpeculativeEmitter emitter(&out, payload, &header, &decodeTable, nw);
+        SpeculativeCollector collector;
+        ff::ff_Farm<SPECULATIVETASK> speculativeFarm(std::move(createWorkers<SpeculativeWorker>(nw)));
+        speculativeFarm.add_emitter(emitter);
+        speculativeFarm.add_collector(collector);
+
+        START(decode)
+        speculativeFarm.run_and_wait_end();
+        STOP(decode, elapsed)
+        reportPhase("decoding", elapsed);
+
+        return collector.ok;
     }
 
-    return decompressedString;
+    // Left uninitialized, so that its pages are first touched by the workers decoding into them
+    std::unique_ptr<char[]> decompressed(new char[header.originalLength]);
+
+    std::vector<WorkerStats> stats(nw);
+    uint64_t nChunks = chunkCount(header.blocks.size(), nw);
+
+    DecompressionEmitter emitter(&out, payload, &header, &decodeTable, decompressed.get(), nChunks);
+    DecompressionCollector collector;
+    ff::ff_Farm<DECOMPRESSIONTASK> decompressionFarm(std::move(createWorkers<DecompressionWorker>(nw, &stats)));
+    decompressionFarm.add_emitter(emitter);
+    decompressionFarm.add_collector(collector);
+    if (!topology) // Otherwise the chunks are dealt by node
+        decompressionFarm.set_scheduling_ondemand();
+
+    START(decode)
+    decompressionFarm.run_and_wait_end();
+    STOP(decode, elapsed)
+    reportPhase("decoding", elapsed);
+
+    printWorkerStats("Decoding", stats, false, topology != nullptr);
+
+    return out.good();
 }
 
-template<typename T>
-std::vector<std::unique_ptr<ff::ff_node>> createWorkers(int nw) {
-    // utimer t("Time spent creating workers ");
-    std::vector<std::unique_ptr<ff::ff_node>> workers;
-    for (int i = 0; i < nw; ++i)
-        workers.push_back(std::make_unique<T>());
-    return workers;
+/* Streaming mode on a pipeline of reader, ordered farm of compressors and writer: the
+    workers compress one segment each, plus the ones being read and written */
+bool streamFile(
+    const std::string& filename, 
+    const bool decompress, 
+    const uint64_t memoryCap, 
+    const unsigned maxLen,
+    const int nw
+) {
+    // Checked before the output is created
+    uint64_t segment = decompress ? 0 : segmentSize(memoryCap, nw + 2, maxLen);
+    if (!decompress && !segment)
+        return false;
+
+    int inFd, outFd;
+    if (!openStream(filename, decompress ? "decompressed_" : "compressed_", inFd, outFd))
+        return false;
+
+    bool ok;
+    if (decompress) {
+        ok = decompressStream(inFd, outFd);
+    } else {
+        SegmentPool pool(nw + 2, segment);
+
+        SegmentReader reader(inFd, &pool);
+        ff::ff_OFarm<Segment> compressors(std::move(createWorkers<SegmentCompressor>(nw, maxLen)));
+        FrameWriter writer(outFd, &pool);
+
+        ff::ff_pipeline pipe;
+        pipe.add_stage(reader);
+        pipe.add_stage(compressors);
+        pipe.add_stage(writer);
+
+        pipe.run_and_wait_end();
+
+        std::cerr << "Frames: " << writer.frames << std::endl;
+        ok = reader.ok && writer.ok;
+    }
+
+    closeStream(inFd, outFd);
+    return ok;
 }
 
 int main(int argc, char** argv) {
-    if (argc < 3 || argc > 4) {
-        std::cout << "Usage: " << argv[0] << " filename nw [verify]" << std::endl;
+    bool decompress = false, stream = false, indexed = true;
+    unsigned maxLen = MAX_CODE_LENGTH;
+    uint64_t memoryCap = DEFAULT_MEMORY_CAP;
+    uint64_t number = 0;
+
+    // The worker count first, as the topology depends on it
+    bool valid = argc >= 3 && argc <= 8 && parseNumber(argv[2], number) && number >= 1 && number <= INT_MAX;
+    int nw = number;
+
+    for (int a = 3; valid && a < argc; ++a) {
+        if (argv[a][0] == 'v')
+            verify = true;
+        else if (argv[a][0] == 'd')
+            decompress = true;
+        else if (argv[a][0] == 's') {
+            stream = true;
+            valid = parseMemoryCap(argv[a] + 1, memoryCap);
+        } else if (argv[a][0] == 'n')
+            topology = std::make_unique<Topology>(nw);
+        else if (argv[a][0] == 'u')
+            indexed = false;
+        else {
+            valid = parseNumber(argv[a], number) && number >= 1;
+            maxLen = std::min<uint64_t>(number, MAX_CODE_LENGTH);
+        }
+    }
+
+    if (!valid) {
+        std::cout << "Usage: " << argv[0] << " filename nw [verify | decompress] [stream[memory cap MiB]] [numa] [unindexed] [max code length]" << std::endl;
         return 1;
     }
 
-    int nw = atoi(argv[2]);
-    verify = argc == 4 && argv[3][0] == 'v';
+    // Topology-aware mode: the workers of every farm pin themselves when they start
+    if (topology)
+        topology->print(stream ? std::cerr : std::cout);
+
+    // Timings go to stderr, as stdout may carry the stream
+    if (stream) {
+        START(streaming)
+        metricsPhase("streaming");
 
-    int fileSize = std::filesystem::file_size(argv[1]);
+        if (!streamFile(argv[1], decompress, memoryCap, maxLen, nw))
+            return 1;
 
-    std::string text;
-    std::unordered_map<char, std::string> charCodeMap;
-    std::string compressedText;
+        STOP(streaming, elapsed)
+        std::cerr << "Total streaming time: " << elapsed << " usecs" << std::endl;
+        reportPhase("total", elapsed);
+
+        return 0;
+    }
+
+    if (decompress) {
+        long elapsed;
+        bool ok;
+        {
+            utimer t("Total decompression time ", &elapsed);
+            ok = decompressFile(argv[1], nw);
+        }
+        reportPhase("total", elapsed);
+
+        return ok ? 0 : 1;
+    }
+
+    // In topology-aware mode the input is loaded by the counting workers
+    MappedFile mapped;
+    LoadedFile loaded;
+    if (topology ? !loaded.open(argv[1]) : !mapped.open(argv[1]))
+        return 1;
+
+    std::string_view text = topology ? loaded.view() : mapped.view();
+    std::atomic<bool> loadFailed(false);
+
+    CodeLengths lengths{};
+    CodeTable codeTable;
+    BitBuffer compressed;
+
+    // Every farm works on the same block-aligned chunks, handed out on demand
+    std::vector<Histogram> maps(chunkCount(blockCount(text.size()), nw)); // Per-chunk histograms
+    HistogramTree tree(nw);
+    std::vector<long> countTimes(nw);
+    std::vector<WorkerStats> readStats(nw), compressionStats(nw);
 
     {
         utimer t("Total program time ");
-        START(dichiarazioni)
 
-        std::unique_ptr<ReadEmitter> mapsEmitter = std::make_unique<ReadEmitter>(argv[1], fileSize, nw);
-        std::unique_ptr<ReadCollector> mapsCollector = std::make_unique<ReadCollector>();
-        ff::ff_Farm<FRTASK> mapsFarm(std::move(createWorkers<ReadWorker>(nw)));
+        std::unique_ptr<ReadEmitter> mapsEmitter = std::make_unique<ReadEmitter>(&text, topology ? &loaded : nullptr, maps.size(), &maps);
+        std::unique_ptr<ReadCollector> mapsCollector = std::make_unique<ReadCollector>(&text, &tree, &countTimes, &readStats, nw);
+        ff::ff_Farm<FRTASK> mapsFarm(std::move(createWorkers<ReadWorker>(nw, &tree, &countTimes, &readStats, &loadFailed)));
         mapsFarm.add_emitter(*mapsEmitter);
         mapsFarm.add_collector(*mapsCollector);
-
-        std::unique_ptr<PairsEmitter> reducersEmitter = std::make_unique<PairsEmitter>();
-        std::unique_ptr<PairsCollector> reducersCollector = std::make_unique<PairsCollector>(&text);
-        ff::ff_Farm<REDTASK> reducersFarm(std::move(createWorkers<PairsReducerWorker>(nw)));
-        reducersFarm.add_emitter(*reducersEmitter);
-        reducersFarm.add_collector(*reducersCollector);
-
-        std::unique_ptr<CodesGenerationEmitter> codesGenerationEmitter = std::make_unique<CodesGenerationEmitter>(&charCodeMap);
-        std::unique_ptr<CodesGenerationCollector> codesGenerationCollector = std::make_unique<CodesGenerationCollector>();
-        ff::ff_Farm<CODESTASK> codesGenerationFarm(std::move(createWorkers<CodesGenerationWorker>(nw)));
-        codesGenerationFarm.add_emitter(*codesGenerationEmitter);
-        codesGenerationFarm.add_collector(*codesGenerationCollector);
-
-        std::unique_ptr<CompressionEmitter> compressionEmitter = std::make_unique<CompressionEmitter>(&text, &compressedText);
-        std::unique_ptr<CompressionCollector> compressionCollector = std::make_unique<CompressionCollector>();
-        ff::ff_Farm<COMPRESSIONTASK> compressionFarm(std::move(createWorkers<CompressionWorker>(nw)));
+        if (!topology) // Otherwise the chunks are dealt by node
+            mapsFarm.set_scheduling_ondemand();
+
+        // The only point where all the chunks have to be counted before going on
+        std::unique_ptr<CodesGeneration> codesGeneration = std::make_unique<CodesGeneration>(&lengths, maxLen);
+
+        /* From here on the chunks stream: the farm encodes them in any order, on demand or
+            dealt by node, and the writer collecting them puts them back in the order of the input */
+        std::unique_ptr<CompressionEmitter> compressionEmitter = std::make_unique<CompressionEmitter>(&text, &codeTable, &compressed, &maps);
+        std::unique_ptr<ChunkWriter> chunkWriter = std::make_unique<ChunkWriter>(
+            verify ? "" : "compressed_" + std::string(argv[1]), indexed, &compressed, &compressionStats
+        );
+        ff::ff_Farm<COMPRESSIONTASK> compressionFarm(std::move(createWorkers<CompressionWorker>(nw, &compressionStats)));
         compressionFarm.add_emitter(*compressionEmitter);
-        compressionFarm.add_collector(*compressionCollector);
+        compressionFarm.add_collector(*chunkWriter);
+        if (!topology) // Otherwise the chunks are dealt by node
+            compressionFarm.set_scheduling_ondemand();
 
         ff::ff_pipeline pipe;
         pipe.add_stage(mapsFarm);
-        pipe.add_stage(reducersFarm);
-        pipe.add_stage(codesGenerationFarm);
+        pipe.add_stage(codesGeneration.get());
         pipe.add_stage(compressionFarm);
 
-        ff::OptLevel opt;   // No performance change
-        opt.remove_collector = true;
-        opt.merge_with_emitter = true;
-        opt.merge_farms = true;
+        START(pipeline)
+        pipe.run_and_wait_end();
+        STOP(pipeline, time)
 
-        if (verify) {
-            // ff::optimize_static(pipe, opt);
-            START(nowrite)
-            pipe.run_and_wait_end();
-            STOP(nowrite, time)
+        if (!chunkWriter->ok || loadFailed)
+            return 1;
 
+        reportPhase("total", time);
+
+        if (verify) {
             std::cout << "Total time without writing: " << time << " usecs" << std::endl;
             
-            std::cerr << decompressStringSequential(compressedText, charCodeMap, fileSize);
-        } else {
-            std::unique_ptr<ToFileCompressionEmitter> toFileCompressionEmitter = std::make_unique<ToFileCompressionEmitter>(argv[1]);
-            std::unique_ptr<ToFileCompressionCollector> toFileCompressionCollector = std::make_unique<ToFileCompressionCollector>();
-            ff::ff_Farm<TOFILETASK> toFileCompressionFarm(std::move(createWorkers<ToFileCompressionWorker>(nw)));
-            toFileCompressionFarm.add_emitter(*toFileCompressionEmitter);
-            toFileCompressionFarm.add_collector(*toFileCompressionCollector);
-            
-            pipe.add_stage(toFileCompressionFarm);
-
-            STOP(dichiarazioni, time)
-            std::cout << "tempo dichiarazioni: " << time << std::endl;
-            // ff::optimize_static(pipe, opt);
-            pipe.run_and_wait_end();
+            std::cerr << decompressStringSequential(compressed, codeTable, text.size());
         }
     }
 
     return 0;
-}
\ No newline at end of file
+}
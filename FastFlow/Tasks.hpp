@@ -3,210 +3,165 @@
 
 #include <vector>
 #include <string>
-#include <mutex>
-#include <unordered_map>
-#include <queue>
+#include <string_view>
 #include <memory>
 
-struct Node {
-    char data;
-    unsigned freq;
-    std::shared_ptr<Node> left, right;
-
-    Node(char data, unsigned freq) :
-        data(data),
-        freq(freq),
-        left(nullptr),
-        right(nullptr)
-    {}   
-};
-
-struct cmp {
-    bool operator()(std::shared_ptr<Node> n1, std::shared_ptr<Node> n2) {
-        if (n1->freq == n2->freq)
-            return n1->data < n2->data;
-        return n1->freq > n2->freq;
-    }
-};
-
-// Task for parallel file reading
+#include "bitstream.hpp"
+#include "histogram.hpp"
+#include "mappedfile.hpp"
+#include "outputfile.hpp"
+#include "codes.hpp"
+#include "container.hpp"
+#include "selfsync.hpp"
+#include "scheduler.hpp"
+#include "numa.hpp"
+
+// Task for counting chunk c of n of the file, loading it first in topology-aware mode
 typedef struct __frtask {
-    char* filename;
-    int fileSize;
-    int nw;
-    int i;
-    std::vector<std::unordered_map<char, unsigned>>* maps;
-    std::vector<std::vector<std::pair<char, unsigned>>>* mapReds;
-    std::vector<std::string>* stringReds;
-    std::vector<std::mutex>* mutexes;
+    std::string_view* text;
+    LoadedFile* loaded;
+    uint64_t n;
+    uint64_t c;
+    std::vector<Histogram>* maps;
 
     __frtask(
-        char* filename, 
-        int fileSize, 
-        int nw,
-        int i,
-        std::vector<std::unordered_map<char, unsigned>>* maps,
-        std::vector<std::vector<std::pair<char, unsigned>>>* mapReds,
-        std::vector<std::string>* stringReds,
-        std::vector<std::mutex>* mutexes
-    ) : filename(filename), 
-        fileSize(fileSize), 
-        nw(nw),
-        i(i),
-        maps(maps), 
-        mapReds(mapReds), 
-        stringReds(stringReds), 
-        mutexes(mutexes) 
+        std::string_view* text, 
+        LoadedFile* loaded,
+        uint64_t n,
+        uint64_t c,
+        std::vector<Histogram>* maps
+    ) : text(text), 
+        loaded(loaded),
+        n(n),
+        c(c),
+        maps(maps)
     {}
 } FRTASK;
 
-// Task used by the reducers farm to work on the read sections of the file
-typedef struct __redtask {
-    std::vector<std::vector<std::pair<char, unsigned>>>* mapReds;
-    std::vector<std::string>* stringReds;
-    std::vector<std::unordered_map<char, unsigned>>* outReducedMaps;
-    int i;
-    int nw;
-
-    __redtask(
-        std::vector<std::vector<std::pair<char, unsigned>>>* mapReds,
-        std::vector<std::string>* stringReds,
-        std::vector<std::unordered_map<char, unsigned>>* outReducedMaps,
-        int i,
-        int nw
-    ) : mapReds(mapReds), stringReds(stringReds), outReducedMaps(outReducedMaps), i(i), nw(nw) {}
-
-    __redtask() {}
-} REDTASK;
-
-// Partial codetask used "astride" of the reducers farm and the codes generation farm
+// Partial codetask used "astride" of the reading farm and the codes generation stage
 typedef struct __parcodetask {
     std::vector<char>* symbols;
-    std::vector<unsigned>* freqs;
+    std::vector<uint64_t>* freqs;
     int nw;
 
     __parcodetask(
         std::vector<char>* symbols,
-        std::vector<unsigned>* freqs,
+        std::vector<uint64_t>* freqs,
         int nw
     ) : symbols(symbols), freqs(freqs), nw(nw) {}
 } PARCODETASK;
 
-// Task used in the codes generation farm
+// Task sent by the codes generation stage to the compression farm
 typedef struct __codestask {
-    std::vector<char>* symbols;
-    std::vector<unsigned>* freqs;
-    std::mutex* queueMutex;
-    std::priority_queue<std::shared_ptr<Node>, std::vector<std::shared_ptr<Node>>, cmp>* q;
-    std::unordered_map<char, std::string>* charCodeMap;
+    CodeLengths* lengths;
     int nw;
-    int i;
 
     __codestask(
-        std::vector<char>* symbols,
-        std::vector<unsigned>* freqs,
-        std::mutex* queueMutex,
-        std::priority_queue<std::shared_ptr<Node>, std::vector<std::shared_ptr<Node>>, cmp>* q,
-        std::unordered_map<char, std::string>* charCodeMap,
-        int nw,
-        int i
-    ) : symbols(symbols), freqs(freqs), queueMutex(queueMutex), q(q), charCodeMap(charCodeMap), nw(nw), i(i) {}
+        CodeLengths* lengths,
+        int nw
+    ) : lengths(lengths), nw(nw) {}
 } CODESTASK;
 
-
+// Chunk token flowing in order through the encoding farm to the writer
 typedef struct __compressiontask {
-    std::string* text;
-    std::unordered_map<char, std::string>* charCodeMap;
-    std::vector<std::string>* compressedResults;
-    std::string* compressedText;
-    int avgCodeLen;
-    int nw;
-    int i;
+    std::string_view* text;
+    CodeTable* codeTable;
+    BitBuffer* compressed;
+    std::vector<uint64_t>* bitOffsets;
+    std::vector<BitTail>* tails;
+    std::vector<BlockEntry>* blocks;
+    uint64_t n;
+    uint64_t c;
 
     __compressiontask(
-        std::string* text,
-        std::unordered_map<char, std::string>* charCodeMap,
-        std::vector<std::string>* compressedResults,
-        std::string* compressedText,
-        int avgCodeLen,
-        int nw,
-        int i
+        std::string_view* text,
+        CodeTable* codeTable,
+        BitBuffer* compressed,
+        std::vector<uint64_t>* bitOffsets,
+        std::vector<BitTail>* tails,
+        std::vector<BlockEntry>* blocks,
+        uint64_t n,
+        uint64_t c
     ) : text(text), 
-        charCodeMap(charCodeMap), 
-        compressedResults(compressedResults),
-        compressedText(compressedText),
-        avgCodeLen(avgCodeLen), 
-        nw(nw),
-        i(i)
+        codeTable(codeTable), 
+        compressed(compressed),
+        bitOffsets(bitOffsets),
+        tails(tails),
+        blocks(blocks),
+        n(n),
+        c(c)
     {}
 } COMPRESSIONTASK;
 
-/* Partial task for the final stage (which can be either writing to file,
-    either none) */
-typedef struct __parfinal {
-    std::string* compressedText;
-    std::unordered_map<char, std::string>* charCodeMap;
-    int avgCodeLen;
-    int nw;
+// Task for loading share c of n of a compressed file in topology-aware mode, on the node of the worker
+typedef struct __loadtask {
+    LoadedFile* loaded;
+    uint64_t n;
+    uint64_t c;
 
-    __parfinal(
-        std::string* compressedText,
-        std::unordered_map<char, std::string>* charCodeMap,
-        int avgCodeLen,
-        int nw
-    ) : compressedText(compressedText), charCodeMap(charCodeMap), avgCodeLen(avgCodeLen), nw(nw) {}
-} PARFINAL;
-
-// Task used when writing the compressed string to the file
-typedef struct __tofiletask {
-    std::string* filename;
-    std::string* compressedText;
-    std::vector<std::pair<int, int>>* textPositions;
-    std::vector<int>* filePositions;
-    int compressedFileSize;
-    int i;
-    int nw;
+    __loadtask(
+        LoadedFile* loaded,
+        uint64_t n,
+        uint64_t c
+    ) : loaded(loaded), n(n), c(c) {}
+} LOADTASK;
 
-    __tofiletask(
-        std::string* filename,
-        std::string* compressedText,
-        std::vector<std::pair<int, int>>* textPositions,
-        std::vector<int>* filePositions,
-        int compressedFileSize,
-        int i,
-        int nw
-    ) : filename(filename), 
-        compressedText(compressedText), 
-        textPositions(textPositions), 
-        filePositions(filePositions), 
-        compressedFileSize(compressedFileSize), 
-        i(i), 
-        nw(nw) 
+// Task used when decoding chunk c of n of the blocks of a compressed file, starting from their sync points
+typedef struct __decompressiontask {
+    OutputFile* out;
+    const char* payload;
+    ContainerHeader* header;
+    DecodeTable* decodeTable;
+    char* decompressed;
+    uint64_t c;
+    uint64_t n;
+
+    __decompressiontask(
+        OutputFile* out,
+        const char* payload,
+        ContainerHeader* header,
+        DecodeTable* decodeTable,
+        char* decompressed,
+        uint64_t c,
+        uint64_t n
+    ) : out(out), 
+        payload(payload), 
+        header(header), 
+        decodeTable(decodeTable), 
+        decompressed(decompressed), 
+        c(c), 
+        n(n) 
     {}
-} TOFILETASK;
+} DECOMPRESSIONTASK;
 
-// Unused -> decompressing in parallel is unfeasible without errors
-typedef struct __decompressiontask {
-    std::string* compressedText; 
-    std::unordered_map<std::string, char>* revCharCodeMap;
-    std::vector<std::string>* decompressedStrings;
-    int avgCodeLen;
+// Task used when decoding a chunk of a stream without block index from an arbitrary bit offset
+typedef struct __speculativetask {
+    OutputFile* out;
+    const char* payload;
+    ContainerHeader* header;
+    DecodeTable* decodeTable;
+    std::vector<std::pair<uint64_t, uint64_t>>* bitPositions;
+    std::vector<SpeculativeChunk>* chunks;
     int i;
     int nw;
 
-    __decompressiontask(
-        std::string* compressedText,
-        std::unordered_map<std::string, char>* revCharCodeMap,
-        std::vector<std::string>* decompressedStrings,
-        int avgCodeLen,
+    __speculativetask(
+        OutputFile* out,
+        const char* payload,
+        ContainerHeader* header,
+        DecodeTable* decodeTable,
+        std::vector<std::pair<uint64_t, uint64_t>>* bitPositions,
+        std::vector<SpeculativeChunk>* chunks,
         int i,
         int nw
-    ) : compressedText(compressedText), 
-        revCharCodeMap(revCharCodeMap), 
-        decompressedStrings(decompressedStrings), 
-        avgCodeLen(avgCodeLen), 
+    ) : out(out), 
+        payload(payload), 
+        header(header), 
+        decodeTable(decodeTable), 
+        bitPositions(bitPositions), 
+        chunks(chunks), 
         i(i), 
         nw(nw) 
     {}
-} DECOMPRESSIONTASK;
+} SPECULATIVETASK;
 #endif
\ No newline at end of file
@@ -1,387 +1,617 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
-#include <unordered_map>
-#include <queue>
 #include <string>
+#include <string_view>
 #include <stdlib.h>
-#include <filesystem>
-#include <thread>
-#include <mutex>
 #include <stdio.h>
 
 #include "utimer.hpp"
+#include "args.hpp"
+#include "report.hpp"
+#include "bitstream.hpp"
+#include "histogram.hpp"
+#include "mappedfile.hpp"
+#include "outputfile.hpp"
+#include "codes.hpp"
+#include "decoder.hpp"
+#include "container.hpp"
+#include "selfsync.hpp"
+#include "stream.hpp"
+#include "threadpool.hpp"
+#include "scheduler.hpp"
+#include "numa.hpp"
+#include "trace.hpp"
+#include "perf.hpp"
+#include "metrics.hpp"
+
+/* Counts chunk c of n into its own histogram, also adding it to the sum of the worker running it;
+    in topology-aware mode the chunk is first loaded, by the same worker */
+bool mapChunk(
+    std::string_view text,
+    LoadedFile* loaded,
+    std::vector<Histogram>& maps,
+    Histogram& sum,
+    const uint64_t c, 
+    const uint64_t n
+) {
+    auto [from, to] = chunkBytes(text.size(), c, n);
 
-struct Node {
-    char data;
-    unsigned freq;
-    std::shared_ptr<Node> left, right;
-
-    Node(char data, unsigned freq) :
-        data(data),
-        freq(freq),
-        left(nullptr),
-        right(nullptr)
-    {}   
-};
-
-struct cmp {
-    bool operator()(std::shared_ptr<Node> n1, std::shared_ptr<Node> n2) {
-        if (n1->freq == n2->freq)
-            return n1->data < n2->data; // Used to match order inside of the heap
-        return n1->freq > n2->freq;
+    if (loaded) {
+        TRACE_SPAN("read")
+        PerfPhase perf("read");
+        if (!loaded->load(from, to))
+            return false;
     }
-};
-
-void mapPairs(
-    const char* filename, 
-    const int fileSize, 
-    std::vector<std::unordered_map<char, unsigned>>& maps,
-    std::vector<std::vector<std::pair<char, unsigned>>>& mapReds,
-    std::vector<std::string>& stringReds,
-    std::vector<std::mutex>& mutexes,
-    const int i, 
-    const int nw
+
+    TRACE_SPAN("histogram")
+    PerfPhase perf("histogram");
+    countSymbols(text.data() + from, text.data() + to, maps[c]);
+    addHistogram(sum, maps[c]);
+    metricsAdd(BYTES_READ, to - from);
+
+    return true;
+}
+
+void compressToBits(
+    std::string_view text, 
+    const CodeTable& codeTable,
+    BitBuffer& compressed,
+    const std::vector<uint64_t>& bitOffsets,
+    std::vector<BitTail>& tails,
+    std::vector<BlockEntry>& blocks,
+    const uint64_t c,
+    const uint64_t n
 ) {
-    utimer t1("tutto");
-    std::fstream file;
-    file.open(filename);
+    TRACE_SPAN("encode")
+    PerfPhase perf("encode");
+    auto [from, to] = chunkBytes(text.size(), c, n);
+
+    BitWriter writer(compressed.words.get(), bitOffsets[c]);
+    encodeBlocks(text.data(), from, to, codeTable, writer, compressed.words.get(), blocks);
+    
+    tails[c] = writer.tail();
+    metricsAdd(BYTES_ENCODED, to - from);
+}
 
-    int delta = fileSize / nw;
-    int from = i * delta;
-    int to = i == nw - 1 ? fileSize : from + delta;
+void compressToFilePar(
+    OutputFile& out,
+    const BitBuffer& compressed,
+    const uint64_t headerSize,
+    const uint64_t c,
+    const uint64_t n
+) {
+    TRACE_SPAN("write")
+    PerfPhase perf("write");
+    auto [from, to] = writeRange(headerSize, compressed.byteSize(), c, n);
+
+    out.write(compressed.bytes() + from, to - from, headerSize + from);
+    metricsAdd(BYTES_WRITTEN, to - from);
+}
+
+std::string decompressStringSequential(
+    const BitBuffer& compressed, 
+    const CodeTable& codeTable,
+    const uint64_t fileSize
+) {
+    DecodeTable decodeTable(codeTable);
 
-    file.seekg(from, std::ios::beg);
+    std::string decompressedString(fileSize, '\0');
+    
+    BitReader reader(compressed.bytes(), compressed.byteSize(), 0);
+    decodeSymbols(decodeTable, reader, decompressedString.data(), fileSize);
 
-    std::string s;
-    s.reserve(delta);
+    return decompressedString;
+} 
 
-    char c;
-    int count = from; // Avoiding tellg() saves much time
-    while (count++ < to && file >> std::noskipws >> c) {
-        ++maps[i][c];
-        s += c;
-    }   
-    stringReds[i] = std::move(s);
+void decompressBlocksPar(
+    OutputFile& out,
+    const char* payload,
+    const ContainerHeader& header,
+    const DecodeTable& decodeTable,
+    char* decompressed,
+    const uint64_t c,
+    const uint64_t n
+) {
+    uint64_t nBlocks = header.blocks.size();
+    auto [first, last] = chunkUnits(nBlocks, c, n);
 
-    file.close();
+    if (first == last)
+        return;
 
     {
-        utimer t2("Hash");
-        for (const auto& pair : maps[i]) {
-            auto pairHash = std::hash<char>{}(pair.first) % nw;
-            std::unique_lock ul(mutexes[pairHash]);
-            mapReds[pairHash].push_back(pair);
-        }
+        TRACE_SPAN("decode")
+        PerfPhase perf("decode");
+        decodeBlocks(payload, header, decodeTable, decompressed, first, last);
     }
+
+    uint64_t from = header.blocks[first].byteOffset;
+    uint64_t to = last < nBlocks ? header.blocks[last].byteOffset : header.originalLength;
+    metricsAdd(BYTES_DECODED, to - from);
+
+    TRACE_SPAN("write")
+    PerfPhase perf("write");
+    out.write(decompressed + from, to - from, from);
+    metricsAdd(BYTES_WRITTEN, to - from);
 }
 
-void reducePairs(
-    const std::vector<std::vector<std::pair<char, unsigned>>>& mapReds,
-    std::mutex& m, 
-    std::unordered_map<char, unsigned>& res,
+void decodeSpeculativePar(
+    const char* payload,
+    const ContainerHeader& header,
+    const DecodeTable& decodeTable,
+    const std::vector<std::pair<uint64_t, uint64_t>>& bitPositions,
+    std::vector<SpeculativeChunk>& chunks,
     const int i
 ) {
-    std::unordered_map<char, unsigned> localRed;
-    for (const auto& [key, value] : mapReds[i]) {
-        localRed[key] += value;
-    }
-    for (const auto& [key, value] : localRed) {
-        std::unique_lock ul(m);
-        res[key] += value;
-    }
+    TRACE_SPAN("decode")
+    PerfPhase perf("decode");
+    decodeSpeculative(payload, header.totalBits, decodeTable, bitPositions[i].first, bitPositions[i].second, chunks[i]);
+    metricsAdd(BYTES_DECODED, chunks[i].symbols.size());
 }
 
-void populateHeap(
-    std::priority_queue<std::shared_ptr<Node>, std::vector<std::shared_ptr<Node>>, cmp>& q,
-    const std::vector<char>& symbols,
-    const std::vector<unsigned>& freqs,
-    std::mutex& queueMutex,
-    const int i,
-    const int nw
+void writeStitchedPar(
+    OutputFile& out,
+    const std::vector<SpeculativeChunk>& chunks,
+    const std::vector<uint64_t>& outOffsets,
+    const int i
 ) {
-    int delta = symbols.size() / nw;
-    int from = i * delta;
-    int to = i == nw - 1 ? symbols.size() : from + delta;
-
-    for (int j = from; j < to; ++j) {
-        queueMutex.lock();
-        q.push(std::make_shared<Node>(symbols[j], freqs[j]));
-        queueMutex.unlock();
-    }
+    TRACE_SPAN("write")
+    PerfPhase perf("write");
+    const SpeculativeChunk& c = chunks[i];
+
+    out.write(c.bridge.data(), c.bridge.size(), outOffsets[i]);
+    out.write(c.symbols.data() + c.validFrom, c.symbols.size() - c.validFrom, outOffsets[i] + c.bridge.size());
+    metricsAdd(BYTES_WRITTEN, c.size());
 }
 
-std::shared_ptr<Node> sequentialTreeGeneration(
-    std::priority_queue<std::shared_ptr<Node>, std::vector<std::shared_ptr<Node>>, cmp>& q
+// Decodes a stream without block index, splitting the payload evenly and stitching the chunks at their sync points
+bool decompressSpeculative(
+    OutputFile& out,
+    const char* payload,
+    const ContainerHeader& header,
+    const DecodeTable& decodeTable,
+    ThreadPool& pool
 ) {
-    std::shared_ptr<Node> left, right, top;
-    while (q.size() > 1) {
-        left = q.top();
-        q.pop();
+    const int nw = pool.size();
+    uint64_t payloadSize = (header.totalBits + 7) / 8;
+    uint64_t delta = payloadSize / nw;
+
+    std::vector<std::pair<uint64_t, uint64_t>> bitPositions(nw);
+    for (int i = 0; i < nw; ++i) {
+        bitPositions[i].first = i * delta * 8;
+        bitPositions[i].second = i == nw - 1 ? header.totalBits : (i + 1) * delta * 8;
+    }
+
+    std::vector<SpeculativeChunk> chunks(nw);
 
-        right = q.top();
-        q.pop();
+    pool.run([&](int i) { decodeSpeculativePar(payload, header, decodeTable, bitPositions, chunks, i); });
 
-        top = std::make_shared<Node>('$', left->freq + right->freq);
+    /* Sequential stitching, usually a few symbols per chunk: each chunk is handed to the
+        pool for writing as soon as its offset is known, while the next one is stitched */
+    uint64_t pos = 0;
+    std::vector<uint64_t> outOffsets(nw + 1, 0);
+    bool ok = true;
+    for (int i = 0; ok && i < nw; ++i) {
+        TRACE_SPAN("stitch")
+        pos = stitchChunk(payload, header.totalBits, decodeTable, pos, bitPositions[i].first, bitPositions[i].second, chunks[i]);
+        outOffsets[i + 1] = outOffsets[i] + chunks[i].size();
 
-        top->left = left;
-        top->right = right;
+        std::cout << "Thread " << i << (chunks[i].synced ? " synced after " : " did not sync, wasted ") 
+            << chunks[i].wastedBits << " bits" << std::endl;
 
-        q.push(top);
+        ok = !chunks[i].corrupted && outOffsets[i + 1] <= header.originalLength;
+        if (ok)
+            pool.submit([&, i] { writeStitchedPar(out, chunks, outOffsets, i); });
     }
 
-    return q.top();
-}
+    pool.wait();
 
-void generateCodes(
-    const std::shared_ptr<Node> root,
-    const std::string currCode, 
-    std::unordered_map<char, std::string>& charCodeMap
-) {
-    if (!root)
-        return;
-    
-    if (root->data != '$')
-        if (!charCodeMap.contains(root->data))
-            charCodeMap[root->data] = currCode;
-    
-    generateCodes(root->left, currCode + "0", charCodeMap);
-    generateCodes(root->right, currCode + "1", charCodeMap);
-}
+    if (!ok || outOffsets[nw] != header.originalLength) {
+        std::cerr << "Truncated or corrupted compressed file" << std::endl;
+        return false;
+    }
 
-void compressToString(
-    const std::string& text, 
-    std::unordered_map<char, std::string>& charCodeMap,
-    std::vector<std::string>& compressedResults,
-    const int avgCodeLen,
-    const int i,
-    const int nw
-) {
-    int delta = text.size() / nw;
-    int from = i * delta;
-    int to = i == nw - 1 ? text.size() : from + delta;
+    return out.good();
+}
 
-    std::string localS;
-    localS.reserve(delta * avgCodeLen);
+// Node of the page holding the first of the bytes at every offset of 'data'
+std::vector<int> offsetNodes(const char* data, const std::vector<uint64_t>& offsets) {
+    std::vector<const void*> addresses;
+    for (uint64_t offset : offsets)
+        addresses.push_back(data + offset);
 
-    for (int j = from; j < to; ++j)
-        localS += charCodeMap[text[j]];
-    
-    compressedResults[i] = std::move(localS);
+    return pageNodes(addresses);
 }
 
-void compressToFilePar(
-    const std::string& filename,
-    const std::string& compressedText,
-    const std::vector<std::pair<int, int>>& textPositions,
-    const std::vector<int>& filePositions,
-    const int compressedFileSize,
-    const int i,
-    const int nw
-) {
-    std::fstream file;
-    file.open(filename);
-
-    file.seekp(filePositions[i]);
-
-    uint8_t b = 0;
-    int len = 0;
-    for (int j = textPositions[i].first; j < textPositions[i].second; ++j) { 
-        if (len < 7) {
-            if (compressedText[j] == '1') ++b;
-            b <<= 1;
-            ++len;
-        } else if (len == 7) {
-            if (compressedText[j] == '1') ++b;
-            len = 0;
-
-            file << b;
-            b = 0;
+/* Decodes a file written by the compression phase, relying only on its header. With a
+    topology, the file is loaded by the workers, each its even share, and the chunks are
+    dealt to the workers of the node holding the start of their payload */
+bool decompressFile(const std::string& filename, ThreadPool& pool, const Topology* topology) {
+    ContainerHeader header;
+    std::string contents;
+    LoadedFile loaded;
+    const char* payload;
+    uint64_t payloadOffset;
+
+    {
+        TRACE_SPAN("read")
+        PerfPhase perf("read");
+        if (topology) {
+            if (!loaded.open(filename))
+                return false;
+
+            std::string_view file = loaded.view();
+            std::atomic<bool> loadFailed(false);
+            pool.run([&](int i) {
+                auto [from, to] = chunkBytes(file.size(), i, pool.size());
+                if (!loaded.load(from, to))
+                    loadFailed = true;
+            });
+
+            if (loadFailed || !parseContainer(file.data(), file.size(), header, payloadOffset))
+                return false;
+
+            payload = file.data() + payloadOffset;
+            metricsAdd(BYTES_READ, file.size());
+        } else {
+            if (!readContainer(filename, header, contents, payloadOffset))
+                return false;
+
+            payload = contents.data() + payloadOffset;
+            metricsAdd(BYTES_READ, contents.size());
         }
     }
-    if (i == nw - 1) {
-        for (int i = 0; i < 7 - len; ++i)
-            b <<= 1;
-        
-        file << b;
+
+    DecodeTable decodeTable(header.codeTable);
+
+    std::string fn = "decompressed_" + filename;
+
+    OutputFile out;
+    if (!out.create(fn, header.originalLength))
+        return false;
+
+    START(decode)
+    metricsPhase("decoding");
+    if (header.blocks.empty()) {
+        bool ok = decompressSpeculative(out, payload, header, decodeTable, pool);
+        STOP(decode, elapsed)
+        reportPhase("decoding", elapsed);
+
+        return ok;
     }
 
-    file.close();
-}
+    // Left uninitialized, so that its pages are first touched by the workers decoding into them
+    std::unique_ptr<char[]> decompressed(new char[header.originalLength]);
 
-std::string decompressStringSequential(
-    const std::string& compressedText, 
-    std::unordered_map<char, std::string>& charCodeMap,
-    const int fileSize
-) {
-    std::unordered_map<std::string, char> revCharCodeMap;
-    for (auto& [key, value] : charCodeMap) 
-        revCharCodeMap[value] = key;
+    // Chunks of blocks are decoded starting from their sync points, and balanced by stealing
+    uint64_t nChunks = chunkCount(header.blocks.size(), pool.size());
+    WorkStealing scheduler(pool.size());
+    if (topology) {
+        std::vector<uint64_t> starts;
+        for (uint64_t c = 0; c < nChunks; ++c)
+            starts.push_back(header.blocks[chunkUnits(header.blocks.size(), c, nChunks).first].bitOffset / 8);
 
-    std::string decompressedString;
-    decompressedString.reserve(fileSize);
-    
-    std::string s = "";
-    for (const char c : compressedText) {
-        s += c;
-        if (revCharCodeMap.contains(s)) {
-            decompressedString += revCharCodeMap[s];
-            s = "";
-        }
+        scheduler.reset(nChunks, offsetNodes(payload, starts), topology->workerNodes());
+    } else {
+        scheduler.reset(nChunks);
     }
 
-    return decompressedString;
-} 
+    pool.run([&](int i) { 
+        scheduler.work(i, [&](uint64_t c) {
+            decompressBlocksPar(out, payload, header, decodeTable, decompressed.get(), c, nChunks); 
+        });
+    });
 
-int main(int argc, char** argv) {
-    if (argc < 3 || argc > 4) {
-        std::cout << "Usage: " << argv[0] << " filename nw [verify]" << std::endl;
-        return 1;
+    printWorkerStats("Decoding", scheduler.workerStats(), true, topology);
+
+    STOP(decode, elapsed)
+    reportPhase("decoding", elapsed);
+
+    return out.good();
+}
+
+/* Streaming mode, from stdin to stdout when the file name is "-": every thread compresses
+    whole segments, so that nw of them are in flight within the memory cap. Frames are
+    decoded one at a time, in order */
+bool streamFile(
+    const std::string& filename, 
+    const bool decompress, 
+    const uint64_t memoryCap, 
+    const unsigned maxLen,
+    ThreadPool& pool
+) {
+    // Checked before the output is created
+    uint64_t segment = decompress ? 0 : segmentSize(memoryCap, pool.size(), maxLen);
+    if (!decompress && !segment)
+        return false;
+
+    int inFd, outFd;
+    if (!openStream(filename, decompress ? "decompressed_" : "compressed_", inFd, outFd))
+        return false;
+
+    bool ok;
+    if (decompress) {
+        ok = decompressStream(inFd, outFd);
+    } else {
+        StreamCompressor compressor(inFd, outFd, segment, maxLen);
+
+        pool.run([&](int) { compressor.work(); });
+
+        ok = compressor.good();
     }
 
-    int nw = atoi(argv[2]);
-    bool verify = argc == 4 && argv[3][0] == 'v';
-    
-    std::vector<std::thread> tids(nw);
+    closeStream(inFd, outFd);
+    return ok;
+}
+
+/* Compresses a file on the workers of the pool, one phase at a time; the pool outlives
+    the call, so that any number of files can be compressed with the same threads.
+    With a topology, the workers are pinned and the input is loaded by the counting workers */
+bool compressFile(
+    const std::string& filename,
+    const bool verify,
+    const bool indexed,
+    const unsigned maxLen,
+    ThreadPool& pool,
+    const Topology* topology
+) {
+    MappedFile mapped;
+    LoadedFile loaded;
+    if (topology ? !loaded.open(filename) : !mapped.open(filename))
+        return false;
 
-    int fileSize = std::filesystem::file_size(argv[1]);
+    std::string_view text = topology ? loaded.view() : mapped.view();
 
-    std::unordered_map<char, unsigned> symbMap;
-    std::mutex redsMutex;
-    std::string text;
+    const int nw = pool.size();
+    HistogramTree tree(nw);
 
-    text.reserve(fileSize);
+    // Every phase is split in the same block-aligned chunks, balanced by stealing
+    uint64_t nChunks = chunkCount(blockCount(text.size()), nw);
+    WorkStealing scheduler(nw);
     
+    // Per-chunk histograms, kept for computing the exact bit offset of each chunk
+    std::vector<Histogram> maps(nChunks);
+
     START(total)
     START(nowrite)
+    metricsPhase("counting");
     {
-        std::vector<std::unordered_map<char, unsigned>> maps(nw);
-        std::vector<std::vector<std::pair<char, unsigned>>> mapReds(nw);
-        std::vector<std::string> stringReds(nw);
-        std::vector<std::mutex> mutexes(nw);
+        std::vector<long> countTimes(nw);
+        std::vector<Histogram> sums(nw);
+        std::atomic<bool> loadFailed(false);
 
         // utimer t1("Mapping file content:\t");
-        for (int i = 0; i < nw; ++i) 
-            tids[i] = std::thread(mapPairs, argv[1], fileSize, std::ref(maps), std::ref(mapReds), std::ref(stringReds), std::ref(mutexes), i, nw);
-        for (int i = 0; i < nw; ++i)
-            tids[i].join();
-    
-    
-        // utimer t2("Reducing read file pairs: ");
-        for (int i = 0; i < nw; ++i)
-            tids[i] = std::thread(reducePairs, std::ref(mapReds), std::ref(redsMutex), std::ref(symbMap), i);
-        
-        for (int i = 0; i < nw; ++i) {
-            tids[i].join();
-            text += stringReds[i]; // Reduction of the ordered strings
-        }
+        // No page is loaded yet, hence the chunks go to the node of their even split, which touches them first
+        if (topology)
+            scheduler.reset(nChunks, std::vector<int>(nChunks, -1), topology->workerNodes());
+        else
+            scheduler.reset(nChunks);
+        pool.run([&](int i) {
+            START(count)
+            scheduler.work(i, [&](uint64_t c) { 
+                if (!mapChunk(text, topology ? &loaded : nullptr, maps, sums[i], c, nChunks))
+                    loadFailed = true;
+            });
+            tree.reduce(sums[i], i);
+            STOP(count, elapsed)
+            countTimes[i] = elapsed;
+        });
+
+        printWorkerStats("Counting", scheduler.workerStats(), true, topology);
+
+        if (loadFailed)
+            return false;
+
+        // Histograms are reduced while counting, hence the slowest worker bounds the whole phase
+        long countTime = *std::max_element(countTimes.begin(), countTimes.end());
+        std::cout << "Histogram: " << static_cast<double>(text.size()) / std::max(1L, countTime) / 1000 << " GB/s" << std::endl;
+        reportPhase("counting", countTime);
     }
 
+    START(codes)
+    metricsPhase("codes");
     // Not parallelized------------------------
     std::vector<char> symbols;
-    std::vector<unsigned> freqs;
+    std::vector<uint64_t> freqs;
     {
         utimer t("Sequential symbol and frequency computation ");
-        symbols.reserve(symbMap.size());
-        freqs.reserve(symbMap.size());
-
-        for (const auto& [sym, freq] : symbMap) {
-            symbols.push_back(sym);
-            freqs.push_back(freq);
-        }
+        populateSymbolsAndFrequencies(tree.total(), symbols, freqs);
     }
     // ----------------------------------------
 
-    std::priority_queue<std::shared_ptr<Node>, std::vector<std::shared_ptr<Node>>, cmp> q;
-    std::shared_ptr<Node> root;
-    std::unordered_map<char, std::string> charCodeMap;
+    CodeLengths lengths;
 
     {
-        std::mutex queueMutex;
-        // utimer t1("Computing codes: ");
-        
-        for (int i = 0; i < nw; ++i) 
-            tids[i] = std::thread(populateHeap, std::ref(q), std::ref(symbols), std::ref(freqs), std::ref(queueMutex), i, nw);
-        for (int i = 0; i < nw; ++i)
-            tids[i].join();
-
-        utimer t("Sequential tree and codes generation ");
-        root = sequentialTreeGeneration(q); // Cannot be parallelized
-        generateCodes(root, "", charCodeMap); // Cannot be parallelized
+        utimer t("Sequential code lengths generation ");
+        TRACE_SPAN("tree")
+        PerfPhase perf("tree");
+        lengths = huffmanCodeLengths(symbols, freqs); // Cannot be parallelized
+
+        if (maxCodeLength(lengths) > maxLen)
+            lengths = packageMerge(symbols, freqs, maxLen);
     }
 
-    int sumSize = 0;
-    for (const auto& [_, v] : charCodeMap)
-        sumSize += v.size();
+    CodeTable codeTable = canonicalCodes(lengths);
 
-    // Needed for reserving approx space for string during compression 
-    int avgCodeLen = sumSize / charCodeMap.size();    
+    /* The chunks read by mapChunk() are the same ones encoded by compressToBits(), 
+        hence their histograms give the exact starting bit of each chunk in the output */
+    std::vector<uint64_t> bitOffsets(nChunks + 1, 0);
+    for (uint64_t c = 0; c < nChunks; ++c)
+        bitOffsets[c + 1] = bitOffsets[c] + encodedBits(maps[c], codeTable);
+    STOP(codes, codesTime)
+    reportPhase("codes", codesTime);
 
-    std::string compressedText;
-    std::vector<std::string> resultingCompressedStrings(nw);
+    START(encode)
+    metricsPhase("encoding");
+    BitBuffer compressed;
+    compressed.allocate(bitOffsets[nChunks]);
+
+    std::vector<BlockEntry> blocks(blockCount(text.size()));
 
     {
+        std::vector<BitTail> tails(nChunks);
+
         // utimer t1("Compressing text: ");
-        for (int i = 0; i < nw; ++i) 
-            tids[i] = std::thread(compressToString, std::ref(text), std::ref(charCodeMap), std::ref(resultingCompressedStrings), avgCodeLen, i, nw);
-        for (int i = 0; i < nw; ++i)
-            tids[i].join();
-        
-        int totSize = 0;
-        for (int i = 0; i < nw; ++i)
-            totSize += resultingCompressedStrings[i].size();
-        
-        compressedText.reserve(totSize);
+        if (topology) { // Where the counting workers actually placed the input
+            std::vector<uint64_t> starts;
+            for (uint64_t c = 0; c < nChunks; ++c)
+                starts.push_back(chunkBytes(text.size(), c, nChunks).first);
+
+            scheduler.reset(nChunks, offsetNodes(text.data(), starts), topology->workerNodes());
+        } else {
+            scheduler.reset(nChunks);
+        }
+        pool.run([&](int i) {
+            scheduler.work(i, [&](uint64_t c) { compressToBits(text, codeTable, compressed, bitOffsets, tails, blocks, c, nChunks); });
+        });
 
-        for (int i = 0; i < nw; ++i) 
-            compressedText += resultingCompressedStrings[i];
+        printWorkerStats("Encoding", scheduler.workerStats(), true, topology);
+        
+        mergeTails(tails); // Only the words shared by adjacent chunks
     }
+    STOP(encode, encodeTime)
+    reportPhase("encoding", encodeTime);
 
     STOP(nowrite, elapsedTimeWithoutWriting);
     std::cout << "Program time without writing compressed data to file: " << elapsedTimeWithoutWriting << " usecs" << std::endl;
 
     if (verify) {
-        std::vector<std::string> decompressedStrings(nw);
-
         // utimer t1("Decompressing: ");
 
-        std::cerr << decompressStringSequential(compressedText, charCodeMap, fileSize);
+        std::cerr << decompressStringSequential(compressed, codeTable, text.size());
     } else {
         // utimer t1("File compression: ");
 
+        START(write)
+        metricsPhase("writing");
         // START(mid)
-        std::string fn = "compressed_" + std::string(argv[1]);
+        std::string fn = "compressed_" + filename;
+
+        ContainerHeader header;
+        header.originalLength = text.size();
+        header.totalBits = bitOffsets[nChunks];
+        header.codeTable = codeTable;
+        if (indexed)
+            header.blocks = std::move(blocks);
+
+        std::string headerBytes = serializeHeader(header);
+        uint64_t headerSize = headerBytes.size();
 
-        /* compressedText is a string, thus each one of its elements is a char of size 1B. 
-            Since we write a byte each 8 chars read from the string, the file size will ultimately be
-            the string size / 8 */
-        int compressedFileSize = compressedText.size() / 8;
+        // The bits are already packed, hence the payload size is the byte size of the buffer
+        uint64_t compressedFileSize = compressed.byteSize();
         
-        FILE* tempFile = fopen(fn.c_str(), "w");
-        fseek(tempFile, compressedFileSize, SEEK_SET);
-        fputc('\0', tempFile);
-        fclose(tempFile);
+        OutputFile out;
+        if (!out.create(fn, headerSize + compressedFileSize) || !out.write(headerBytes.data(), headerSize, 0))
+            return false;
         
         // STOP(mid, m)
         // std::cout << "Time spent on creating file: " << m << std::endl;
 
-        std::vector<std::pair<int, int>> textPositions(nw);
-        std::vector<int> filePositions(nw);
-        int delta = compressedText.size() / nw;
-        delta += delta % 8 == 0 ? 0 : 8 - (delta % 8);
-        for (int i = 0; i < nw; ++i) {
-            textPositions[i].first = i * delta;
-            textPositions[i].second = i == nw - 1 ? compressedText.size() : (i + 1) * delta;
-            filePositions[i] = textPositions[i].first / 8;
+        if (topology) { // The output pages were first touched by the encoding workers
+            std::vector<uint64_t> starts;
+            for (uint64_t c = 0; c < nChunks; ++c)
+                starts.push_back(writeRange(headerSize, compressed.byteSize(), c, nChunks).first);
+
+            scheduler.reset(nChunks, offsetNodes(compressed.bytes(), starts), topology->workerNodes());
+        } else {
+            scheduler.reset(nChunks);
         }
+        pool.run([&](int i) {
+            scheduler.work(i, [&](uint64_t c) { compressToFilePar(out, compressed, headerSize, c, nChunks); });
+        });
+
+        printWorkerStats("Writing", scheduler.workerStats(), true, topology);
 
-        for (int i = 0; i < nw; ++i)
-            tids[i] = std::thread(compressToFilePar, std::ref(fn), std::ref(compressedText), std::ref(textPositions), std::ref(filePositions), compressedFileSize, i, nw);
-        for (int i = 0; i < nw; ++i)
-            tids[i].join();
+        if (!out.good())
+            return false;
+
+        STOP(write, writeTime)
+        reportPhase("writing", writeTime);
     }
     STOP(total, elapsed)
     std::cout << "Total program time: " << elapsed << " usecs" << std::endl;
+    reportPhase("total", elapsed);
 
-    return 0;
-}
\ No newline at end of file
+    return true;
+}
+
+int main(int argc, char** argv) {
+    bool verify = false, decompress = false, stream = false, numa = false, indexed = true;
+    unsigned maxLen = MAX_CODE_LENGTH;
+    uint64_t memoryCap = DEFAULT_MEMORY_CAP;
+    uint64_t number = 0;
+
+    // The worker count first, as the topology depends on it
+    bool valid = argc >= 3 && argc <= 8 && parseNumber(argv[2], number) && number >= 1 && number <= INT_MAX;
+    int nw = number;
+
+    for (int a = 3; valid && a < argc; ++a) {
+        if (argv[a][0] == 'v')
+            verify = true;
+        else if (argv[a][0] == 'd')
+            decompress = true;
+        else if (argv[a][0] == 's') {
+            stream = true;
+            valid = parseMemoryCap(argv[a] + 1, memoryCap);
+        } else if (argv[a][0] == 'n')
+            numa = true;
+        else if (argv[a][0] == 'u')
+            indexed = false;
+        else {
+            valid = parseNumber(argv[a], number) && number >= 1;
+            maxLen = std::min<uint64_t>(number, MAX_CODE_LENGTH);
+        }
+    }
+
+    if (!valid) {
+        std::cout << "Usage: " << argv[0] << " filename nw [verify | decompress] [stream[memory cap MiB]] [numa] [unindexed] [max code length]" << std::endl;
+        return 1;
+    }
+    
+    ThreadPool pool(nw);
+
+    // Topology-aware mode: every worker is pinned once, for all the phases
+    std::unique_ptr<Topology> topology;
+    if (numa) {
+        topology = std::make_unique<Topology>(nw);
+        topology->print(stream ? std::cerr : std::cout);
+
+        std::atomic<bool> pinned(true);
+        pool.run([&](int i) {
+            if (!topology->pin(i))
+                pinned = false;
+        });
+
+        if (!pinned)
+            std::cerr << "Could not pin all the workers" << std::endl;
+    }
+
+    // Timings go to stderr, as stdout may carry the stream
+    if (stream) {
+        START(streaming)
+        metricsPhase("streaming");
+
+        if (!streamFile(argv[1], decompress, memoryCap, maxLen, pool))
+            return 1;
+
+        STOP(streaming, elapsed)
+        std::cerr << "Total streaming time: " << elapsed << " usecs" << std::endl;
+        reportPhase("total", elapsed);
+
+        return 0;
+    }
+
+    if (decompress) {
+        START(decomp)
+
+        if (!decompressFile(argv[1], pool, topology.get()))
+            return 1;
+
+        STOP(decomp, elapsed)
+        std::cout << "Total decompression time: " << elapsed << " usecs" << std::endl;
+        reportPhase("total", elapsed);
+
+        return 0;
+    }
+
+    return compressFile(argv[1], verify, indexed, maxLen, pool, topology.get()) ? 0 : 1;
+}
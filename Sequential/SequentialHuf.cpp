@@ -1,229 +1,328 @@
 #include <iostream>
-#include <queue>
 #include <string>
 #include <vector>
 #include <fstream>
-#include <filesystem>
-#include <unordered_map>
+#include <string_view>
 #include "utimer.hpp"
-
-struct Node {
-    char data;
-    unsigned freq;
-    std::shared_ptr<Node> left, right;
-
-    Node(char data, unsigned freq) :
-        data(data),
-        freq(freq),
-        left(nullptr),
-        right(nullptr)
-    {}   
-};
-
-void getTextAndMapChars(
-    const char* filename, 
-    std::unordered_map<char, unsigned>& map, 
-    std::string& text
+#include "args.hpp"
+#include "report.hpp"
+#include "bitstream.hpp"
+#include "histogram.hpp"
+#include "mappedfile.hpp"
+#include "codes.hpp"
+#include "decoder.hpp"
+#include "container.hpp"
+#include "outputfile.hpp"
+#include "pipeline.hpp"
+#include "stream.hpp"
+#include "trace.hpp"
+#include "perf.hpp"
+#include "metrics.hpp"
+
+// Counts the symbols of the mapped file, returning the time spent through 'countTime'
+void mapChars(
+    std::string_view text,
+    Histogram& histogram, 
+    long& countTime
 ) {
-    std::fstream file;
-    file.open(filename);
-
-    if (!file.is_open()) {
-        std::cerr << "Could not open the file" << std::endl;
-        return;
-    }
-    
-    char c;
-    while (file >> std::noskipws >> c) {
-        ++map[c];
-        text +=  c;
-    }
-
-    file.close();
+    TRACE_SPAN("histogram")
+    PerfPhase perf("histogram");
+    START(count)
+    countSymbols(text.data(), text.data() + text.size(), histogram);
+    metricsAdd(BYTES_READ, text.size());
+    STOP(count, elapsed)
+    countTime = elapsed;
 }
 
-void populateSymbolsAndFrequencies(
-    std::unordered_map<char, unsigned>& symbMap, 
-    std::vector<char>& symbols, 
-    std::vector<unsigned>& freqs
+void compressToBits(
+    std::string_view text, 
+    const CodeTable& codeTable,
+    BitBuffer& compressed,
+    std::vector<BlockEntry>& blocks,
+    const uint64_t totalBits
 ) {
-    symbols.reserve(symbMap.size());
-    freqs.reserve(symbMap.size());
-
-    for (auto& [key, value] : symbMap) {
-        symbols.push_back(key);
-        freqs.push_back(value);
-    }
+    TRACE_SPAN("encode")
+    PerfPhase perf("encode");
+    compressed.allocate(totalBits);
+    blocks.resize(blockCount(text.size()));
+
+    BitWriter writer(compressed.words.get(), 0);
+    encodeBlocks(text.data(), 0, text.size(), codeTable, writer, compressed.words.get(), blocks);
+    writer.finish();
+    metricsAdd(BYTES_ENCODED, text.size());
 }
 
-struct cmp {
-    bool operator()(std::shared_ptr<Node> n1, std::shared_ptr<Node> n2) {
-        if (n1->freq == n2->freq)
-            return n1->data < n2->data;
-        return n1->freq > n2->freq;
+/* Second pass over the file, reading, encoding and writing blocks at the same time;
+    the header is written last, once the sync points of the blocks are known, unless
+    they are left out of it */
+bool compressToFile(
+    const std::string& filename, 
+    ContainerHeader& header,
+    const bool indexed
+) {
+    int inFd = open(filename.c_str(), O_RDONLY);
+    if (inFd < 0) {
+        std::cerr << "Could not open the file" << std::endl;
+        return false;
     }
-};
 
-std::shared_ptr<Node> generateTree(const std::vector<char>& symbols, const std::vector<unsigned>& freqs, const int size) {
-    std::shared_ptr<Node> left, right, top;
+    // Same size as the final header, whose block index is not filled yet
+    std::vector<BlockEntry> blocks(blockCount(header.originalLength));
+    if (indexed)
+        header.blocks.resize(blocks.size());
+    uint64_t headerSize = serializeHeader(header).size();
 
-    std::priority_queue<std::shared_ptr<Node>, std::vector<std::shared_ptr<Node>>, cmp> q;
+    OutputFile out;
+    bool ok = out.create("compressed_" + filename, headerSize + (header.totalBits + 7) / 8);
 
-    for (int i = 0; i < size; ++i)
-        q.push(std::make_shared<Node>(symbols[i], freqs[i]));
+    if (ok) {
+        auto io = createAsyncIO(PIPELINE_IO_DEPTH);
+        if (std::string_view(io->name()) == "threads") // io_uring is missing or forbidden, as in some containers
+            std::cerr << "io_uring is not available, I/O goes through a helper thread" << std::endl;
 
-    while (q.size() > 1) {
-        left = q.top();
-        q.pop();
+        uint64_t bits = 0;
+        ok = encodeFilePipelined(*io, inFd, header.originalLength, header.codeTable, out.descriptor(), headerSize, blocks, bits);
 
-        right = q.top();
-        q.pop();
+        if (ok && bits != header.totalBits) {
+            std::cerr << "The file changed while compressing it" << std::endl;
+            ok = false;
+        }
+    }
 
-        top = std::make_shared<Node>('$', left->freq + right->freq);
+    close(inFd);
 
-        top->left = left;
-        top->right = right;
+    if (ok) {
+        if (indexed)
+            header.blocks = std::move(blocks);
 
-        q.push(top);
+        std::string headerBytes = serializeHeader(header);
+        ok = out.write(headerBytes.data(), headerBytes.size(), 0);
     }
 
-    return q.top();
-}
-
-void generateCodes(const std::shared_ptr<Node> root, const std::string s, std::unordered_map<char, std::string>& charCodeMap) {
-    if (!root)
-        return;
-    
-    if (root->data != '$')
-        if (!charCodeMap.contains(root->data))
-            charCodeMap[root->data] = s;
-    
-    generateCodes(root->left, s + "0", charCodeMap);
-    generateCodes(root->right, s + "1", charCodeMap);    
+    return ok;
 }
 
-std::string compressToString(
-    const std::string& text, 
-    std::unordered_map<char, std::string>& charCodeMap,
-    const int avg
+std::string decompressString(
+    const BitBuffer& compressed, 
+    const CodeTable& codeTable,
+    const uint64_t fileSize
 ) {
-    std::string compressedText;
-    compressedText.reserve(text.size() * avg);
+    TRACE_SPAN("decode")
+    PerfPhase perf("decode");
+    DecodeTable decodeTable(codeTable);
 
-    for (const char c : text)
-        compressedText += charCodeMap[c];
+    std::string decompressedString(fileSize, '\0');
     
-    return compressedText;
-}
+    BitReader reader(compressed.bytes(), compressed.byteSize(), 0);
+    decodeSymbols(decodeTable, reader, decompressedString.data(), fileSize);
 
-void compressToFile(
-    const std::string& filename, 
-    const std::string& text, 
-    std::unordered_map<char, std::string>& charCodeMap
-) {
+    return decompressedString;
+} 
+
+// Decodes a file written by compressToFile(), relying only on its header
+bool decompressFile(const std::string& filename) {
+    ContainerHeader header;
+    std::string contents;
+    uint64_t payloadOffset;
+
+    {
+        TRACE_SPAN("read")
+        PerfPhase perf("read");
+        if (!readContainer(filename, header, contents, payloadOffset))
+            return false;
+    }
+    metricsAdd(BYTES_READ, contents.size());
+
+    START(decode)
+    metricsPhase("decoding");
+    std::string decompressedString(header.originalLength, '\0');
+    {
+        TRACE_SPAN("decode")
+        PerfPhase perf("decode");
+        DecodeTable decodeTable(header.codeTable);
+
+        BitReader reader(contents.data() + payloadOffset, (header.totalBits + 7) / 8, 0);
+        decodeSymbols(decodeTable, reader, decompressedString.data(), header.originalLength);
+    }
+    metricsAdd(BYTES_DECODED, decompressedString.size());
+    STOP(decode, decodeTime)
+    reportPhase("decoding", decodeTime);
+
+    TRACE_SPAN("write")
+    PerfPhase perf("write");
     std::ofstream file;
-    file.open("compressed_" + filename);
-
-    uint8_t b = 0;
-    int l = 0;
-    for (char c : text) {
-        for (char bit : charCodeMap[c]) {
-            if (l < 7) {
-                if (bit == '1') ++b;
-                b <<= 1;
-                ++l;
-            } else if (l == 7) {
-                if (bit == '1') ++b;
-                l = 0;
-
-                file << b;
-                b = 0;
-            }
-        }
+    file.open("decompressed_" + filename, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Could not create the file" << std::endl;
+        return false;
     }
-    for (int i = 0; i < 7 - l; ++i)
-        b <<= 1;
-    
-    file << b;
+
+    file.write(decompressedString.data(), decompressedString.size());
     file.close();
+    if (!file.good()) {
+        std::cerr << "Could not write the file" << std::endl;
+        return false;
+    }
+    metricsAdd(BYTES_WRITTEN, decompressedString.size());
+
+    return true;
 }
 
-std::string decompressString(
-    const std::string& compressedText, 
-    std::unordered_map<char, std::string>& charCodeMap,
-    const int fileSize
+/* Streaming mode, from stdin to stdout when the file name is "-": segments are read,
+    compressed and written one at a time, each within the memory cap */
+bool streamFile(
+    const std::string& filename, 
+    const bool decompress, 
+    const uint64_t memoryCap, 
+    const unsigned maxLen
 ) {
-    std::unordered_map<std::string, char> revCharCodeMap;
-    for (auto& [key, value] : charCodeMap) 
-        revCharCodeMap[value] = key;
-
-    std::string decompressedString;
-    decompressedString.reserve(fileSize);
-    
-    std::string s = "";
-    for (const char c : compressedText) {
-        s += c;
-        if (revCharCodeMap.contains(s)) {
-            decompressedString += revCharCodeMap[s];
-            s = "";
-        }
+    // Checked before the output is created
+    uint64_t segment = decompress ? 0 : segmentSize(memoryCap, 1, maxLen);
+    if (!decompress && !segment)
+        return false;
+
+    int inFd, outFd;
+    if (!openStream(filename, decompress ? "decompressed_" : "compressed_", inFd, outFd))
+        return false;
+
+    bool ok;
+    if (decompress) {
+        ok = decompressStream(inFd, outFd);
+    } else {
+        StreamCompressor compressor(inFd, outFd, segment, maxLen);
+        compressor.work();
+        ok = compressor.good();
     }
 
-    return decompressedString;
-} 
+    closeStream(inFd, outFd);
+    return ok;
+}
 
 int main(int argc, char** argv) {
-    if (argc < 2 || argc > 3) {
-        std::cout << "Usage: " << argv[0] << " filename [verify]" << std::endl;
+    bool verify = false, decompress = false, stream = false, indexed = true;
+    unsigned maxLen = MAX_CODE_LENGTH;
+    uint64_t memoryCap = DEFAULT_MEMORY_CAP;
+    uint64_t number = 0;
+
+    bool valid = argc >= 2 && argc <= 6;
+    for (int a = 2; valid && a < argc; ++a) {
+        if (argv[a][0] == 'v')
+            verify = true;
+        else if (argv[a][0] == 'd')
+            decompress = true;
+        else if (argv[a][0] == 's') {
+            stream = true;
+            valid = parseMemoryCap(argv[a] + 1, memoryCap);
+        } else if (argv[a][0] == 'u')
+            indexed = false;
+        else {
+            valid = parseNumber(argv[a], number) && number >= 1;
+            maxLen = std::min<uint64_t>(number, MAX_CODE_LENGTH);
+        }
+    }
+
+    if (!valid) {
+        std::cout << "Usage: " << argv[0] << " filename [verify | decompress] [stream[memory cap MiB]] [unindexed] [max code length]" << std::endl;
         return 1;
     }
 
-    bool verify = argc == 3 && argv[2][0] == 'v';
+    // Timings go to stderr, as stdout may carry the stream
+    if (stream) {
+        START(seqStream)
+        metricsPhase("streaming");
 
-    std::unordered_map<char, unsigned> symbMap;
-    std::string text;
+        if (!streamFile(argv[1], decompress, memoryCap, maxLen))
+            return 1;
 
-    START(seqComp)
+        STOP(seqStream, timeStream)
+        std::cerr << "streaming: " << timeStream << " usecs" << std::endl;
+        reportPhase("total", timeStream);
 
-    int fileSize = std::filesystem::file_size(argv[1]);
-    text.reserve(fileSize);
+        return 0;
+    }
 
-    getTextAndMapChars(argv[1], symbMap, text);
+    if (decompress) {
+        START(seqDecomp)
+        
+        if (!decompressFile(argv[1]))
+            return 1;
 
-    if (!symbMap.size())
+        STOP(seqDecomp, timeDecomp)
+        std::cout << "decompression: " << timeDecomp << " usecs" << std::endl;
+        reportPhase("total", timeDecomp);
+
+        return 0;
+    }
+
+    Histogram histogram{};
+    MappedFile input;
+
+    START(seqComp)
+
+    if (!input.open(argv[1]))
         return 1;
 
-    std::vector<char> symbols;
-    std::vector<unsigned> freqs;
+    std::string_view text = input.view();
+
+    long countTime = 0;
+    metricsPhase("counting");
+    mapChars(text, histogram, countTime);
 
-    populateSymbolsAndFrequencies(symbMap, symbols, freqs);   
+    std::cout << "Histogram: " << static_cast<double>(text.size()) / std::max(1L, countTime) / 1000 << " GB/s" << std::endl;
+    reportPhase("counting", countTime);
 
-    std::unordered_map<char, std::string> charCodeMap; 
+    START(codes)
+    metricsPhase("codes");
+    std::vector<char> symbols;
+    std::vector<uint64_t> freqs;
+
+    populateSymbolsAndFrequencies(histogram, symbols, freqs);   
 
-    std::shared_ptr<Node> root = generateTree(symbols, freqs, symbols.size());
+    CodeLengths lengths;
+    {
+        TRACE_SPAN("tree")
+        PerfPhase perf("tree");
+        lengths = huffmanCodeLengths(symbols, freqs);
 
-    generateCodes(root, "", charCodeMap);
+        if (maxCodeLength(lengths) > maxLen)
+            lengths = packageMerge(symbols, freqs, maxLen);
+    }
 
-    int sumSize = 0;
-    for (const auto& [_, v] : charCodeMap)
-        sumSize += v.size();
+    CodeTable codeTable = canonicalCodes(lengths);
 
-    // Needed for reserving approx space for string in 'compressToString()' 
-    int avgCodeLen = sumSize / charCodeMap.size(); 
+    // Exact size of the compressed stream, used for allocating its space
+    uint64_t totalBits = encodedBits(histogram, codeTable);
+    STOP(codes, codesTime)
+    reportPhase("codes", codesTime);
 
+    // Reading and writing overlap the encoding, hence they are part of its phase
+    START(encode)
+    metricsPhase("encoding");
     if (verify) {
+        BitBuffer compressed;
+        std::vector<BlockEntry> blocks;
+        compressToBits(text, codeTable, compressed, blocks, totalBits);
 
-        std::string compressedString = compressToString(text, charCodeMap, avgCodeLen);
-        
-        text = decompressString(compressedString, charCodeMap, fileSize);
-        
-        std::cerr << text;
+        STOP(encode, encodeTime)
+        reportPhase("encoding", encodeTime);
+
+        std::cerr << decompressString(compressed, codeTable, text.size());
     } else {
-        compressToFile(argv[1], text, charCodeMap);
+        ContainerHeader header;
+        header.originalLength = text.size();
+        header.totalBits = totalBits;
+        header.codeTable = codeTable;
+
+        if (!compressToFile(argv[1], header, indexed))
+            return 1;
+
+        STOP(encode, encodeTime)
+        reportPhase("encoding", encodeTime);
     }
 
     STOP(seqComp, timeComp)
     std::cout << "computation: " << timeComp << " usecs" << std::endl;
+    reportPhase("total", timeComp);
 
     return 0;
 }
\ No newline at end of file
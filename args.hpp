@@ -0,0 +1,31 @@
+#ifndef ARGS_H
+#define ARGS_H
+
+#include <charconv>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+/* Numeric arguments of the programs: only a purely decimal argument is a number, so that
+    a mistyped flag is reported instead of being read as 0 */
+inline bool parseNumber(const char* arg, uint64_t& value) {
+    const char* end = arg + std::strlen(arg);
+    auto [ptr, ec] = std::from_chars(arg, end, value);
+
+    return arg != end && ec == std::errc() && ptr == end;
+}
+
+// Memory cap given in MiB after the stream flag, as in "s256"; none keeps 'cap' as it is
+inline bool parseMemoryCap(const char* arg, uint64_t& cap) {
+    uint64_t mib;
+    if (!*arg)
+        return true;
+    if (!parseNumber(arg, mib) || !mib || mib > UINT64_MAX >> 20)
+        return false;
+
+    cap = mib << 20;
+    return true;
+}
+
+#endif
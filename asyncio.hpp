@@ -0,0 +1,298 @@
+#ifndef ASYNCIO_H
+#define ASYNCIO_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Defined by linux/fs.h, included by io_uring.h, and unrelated to the blocks of the container
+#undef BLOCK_SIZE
+#undef BLOCK_SIZE_BITS
+
+// Positioned read or write, identified in its completion by 'tag'
+struct IoRequest {
+    bool write;
+    int fd;
+    char* buf;
+    uint32_t len;
+    uint64_t offset;
+    uint64_t tag;
+    int bufIndex; // Index among the registered buffers, -1 if 'buf' is not in one of them
+};
+
+struct IoCompletion {
+    uint64_t tag;
+    int64_t result; // Bytes transferred, or -errno
+};
+
+/* Asynchronous positioned I/O: requests are submitted without blocking and complete
+    in any order. At most 'depth' requests, as given on creation, may be in flight */
+class AsyncIO {
+public:
+    virtual ~AsyncIO() {}
+
+    // Buffers which stay valid for the lifetime of the engine, which may pin them once
+    virtual void registerBuffers(const std::vector<iovec>&) {}
+
+    virtual bool submit(const IoRequest& r) = 0;
+
+    // Blocks until a request completes
+    virtual bool wait(IoCompletion& c) = 0;
+
+    /* Blocks until 'inFlight' requests complete, discarding their results: once wait() has
+        failed, the buffers of the requests still in flight may only be released after this */
+    virtual void drain(unsigned inFlight) = 0;
+
+    virtual const char* name() const = 0;
+};
+
+/* io_uring driven through its system calls: requests are written to the submission ring
+    and reaped from the completion ring, both shared with the kernel */
+class IoUring : public AsyncIO {
+    int fd;
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    io_uring_sqe* sqes;
+    size_t sqesSize;
+
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+
+    bool fixed;
+
+    static int setup(unsigned entries, io_uring_params* p) {
+        return syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+        return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+    }
+
+public:
+    IoUring() : fd(-1), sqRing(MAP_FAILED), sqRingSize(0), cqRing(MAP_FAILED), cqRingSize(0),
+        sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), sqesSize(0), fixed(false) {}
+
+    ~IoUring() {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    // False when io_uring is missing, disabled, or lacks plain read and write operations (before 5.6)
+    bool init(unsigned depth) {
+        io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+
+        fd = setup(depth, &p);
+        if (fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_RW_CUR_POS))
+            return false;
+
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return false;
+        cqRing = sqRing;
+
+        sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+            return false;
+
+        char* sq = static_cast<char*>(sqRing);
+        sqTail = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+
+        char* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+        return true;
+    }
+
+    // Pins the buffers, so that requests on them skip the page mapping; plain requests are used if it fails
+    void registerBuffers(const std::vector<iovec>& buffers) override {
+        fixed = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) == 0;
+    }
+
+    bool submit(const IoRequest& r) override {
+        // Single producer: only the kernel reads the tail concurrently
+        unsigned tail = *sqTail;
+        unsigned index = tail & *sqMask;
+
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+
+        bool useFixed = fixed && r.bufIndex >= 0;
+        if (r.write)
+            sqe->opcode = useFixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        else
+            sqe->opcode = useFixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+
+        sqe->fd = r.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(r.buf);
+        sqe->len = r.len;
+        sqe->off = r.offset;
+        sqe->user_data = r.tag;
+        if (useFixed)
+            sqe->buf_index = r.bufIndex;
+
+        sqArray[index] = index;
+        std::atomic_ref<unsigned>(*sqTail).store(tail + 1, std::memory_order_release);
+
+        int ret;
+        while ((ret = enter(1, 0, 0)) < 0 && errno == EINTR)
+            ;
+
+        // Not consumed by the kernel, which only reads the ring when entered: taken back, so that no later call submits it
+        if (ret < 0)
+            std::atomic_ref<unsigned>(*sqTail).store(tail, std::memory_order_release);
+
+        return ret >= 0;
+    }
+
+    bool wait(IoCompletion& c) override {
+        while (true) {
+            unsigned head = *cqHead;
+            if (head != std::atomic_ref<unsigned>(*cqTail).load(std::memory_order_acquire)) {
+                const io_uring_cqe& cqe = cqes[head & *cqMask];
+                c = {cqe.user_data, cqe.res};
+                std::atomic_ref<unsigned>(*cqHead).store(head + 1, std::memory_order_release);
+
+                return true;
+            }
+
+            if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+                return false;
+        }
+    }
+
+    // Completions are posted to the ring even when io_uring_enter() fails, their pending work runs on the return from any system call
+    void drain(unsigned inFlight) override {
+        while (inFlight) {
+            unsigned head = *cqHead;
+            if (head != std::atomic_ref<unsigned>(*cqTail).load(std::memory_order_acquire)) {
+                std::atomic_ref<unsigned>(*cqHead).store(head + 1, std::memory_order_release);
+                --inFlight;
+                continue;
+            }
+
+            if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+                timespec pause{0, 1000000};
+                nanosleep(&pause, nullptr);
+            }
+        }
+    }
+
+    const char* name() const override { return fixed ? "io_uring (fixed buffers)" : "io_uring"; }
+};
+
+// Fallback where io_uring is not available: a thread serving the requests in order with pread/pwrite
+class ThreadIO : public AsyncIO {
+    std::mutex m;
+    std::condition_variable requestsCv;
+    std::condition_variable completionsCv;
+    std::deque<IoRequest> requests;
+    std::deque<IoCompletion> completions;
+    bool stop;
+    std::thread worker;
+
+    void serve() {
+        std::unique_lock ul(m);
+        while (true) {
+            requestsCv.wait(ul, [&] { return stop || !requests.empty(); });
+            if (requests.empty())
+                return;
+
+            IoRequest r = requests.front();
+            requests.pop_front();
+            ul.unlock();
+
+            ssize_t n = r.write ? pwrite(r.fd, r.buf, r.len, r.offset) : pread(r.fd, r.buf, r.len, r.offset);
+            IoCompletion c{r.tag, n < 0 ? -errno : n};
+
+            ul.lock();
+            completions.push_back(c);
+            completionsCv.notify_one();
+        }
+    }
+
+public:
+    ThreadIO() : stop(false), worker(&ThreadIO::serve, this) {}
+
+    ~ThreadIO() {
+        {
+            std::unique_lock ul(m);
+            stop = true;
+        }
+        requestsCv.notify_one();
+        worker.join();
+    }
+
+    bool submit(const IoRequest& r) override {
+        std::unique_lock ul(m);
+        requests.push_back(r);
+        requestsCv.notify_one();
+
+        return true;
+    }
+
+    bool wait(IoCompletion& c) override {
+        std::unique_lock ul(m);
+        completionsCv.wait(ul, [&] { return !completions.empty(); });
+        c = completions.front();
+        completions.pop_front();
+
+        return true;
+    }
+
+    void drain(unsigned inFlight) override {
+        IoCompletion c;
+        for (; inFlight; --inFlight)
+            wait(c);
+    }
+
+    const char* name() const override { return "threads"; }
+};
+
+inline std::unique_ptr<AsyncIO> createAsyncIO(unsigned depth) {
+    auto ring = std::make_unique<IoUring>();
+    if (ring->init(depth))
+        return ring;
+
+    return std::make_unique<ThreadIO>();
+}
+
+#endif
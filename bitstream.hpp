@@ -0,0 +1,452 @@
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define HUF_X86
+#endif
+
+#include "histogram.hpp"
+
+// Flat code table entry: the code is right-aligned in 'bits', 'len' bits long
+struct Code {
+    uint64_t bits;
+    unsigned len;
+};
+
+using CodeTable = std::array<Code, 256>;
+
+/* Packed bitstream: bits are MSB-first and each 64-bit word is stored big-endian,
+    so that the underlying memory is already the byte sequence written to file */
+struct BitBuffer {
+    std::unique_ptr<uint64_t[]> words;
+    uint64_t bits = 0;
+
+    // Left uninitialized: every word is stored by a writer, except the last partial one
+    void allocate(uint64_t totalBits) {
+        words.reset(new uint64_t[totalBits / 64 + 1]);
+        words[totalBits / 64] = 0;
+        bits = totalBits;
+    }
+
+    const char* bytes() const { return reinterpret_cast<const char*>(words.get()); }
+    uint64_t byteSize() const { return (bits + 7) / 8; }
+};
+
+// Last partial word of a writer, to be merged with the word shared by its neighbour
+struct BitTail {
+    uint64_t* pos;
+    uint64_t word;
+};
+
+inline uint64_t toBigEndian(uint64_t w) {
+    if constexpr (std::endian::native == std::endian::little)
+        return __builtin_bswap64(w);
+    return w;
+}
+
+inline uint64_t fromBigEndian(uint64_t w) { return toBigEndian(w); }
+
+/* Accumulates codes in a 64-bit register and stores full words starting from an
+    arbitrary bit offset of a preallocated buffer. The bits preceding the offset in
+    the first word are left as zeros and have to be merged by the caller */
+class BitWriter {
+    uint64_t* out;
+    uint64_t acc;
+    unsigned free; // Free bits left in acc, always in [1, 64]
+
+public:
+    BitWriter(uint64_t* words, uint64_t bitOffset) : 
+        out(words + bitOffset / 64), 
+        acc(0), 
+        free(64 - bitOffset % 64) 
+    {}
+
+    // Requires 1 <= len <= 64
+    inline void put(uint64_t code, unsigned len) {
+        if (len < free) {
+            acc |= code << (free - len);
+            free -= len;
+            return;
+        }
+
+        len -= free; // Bits which do not fit in the current word
+        acc |= code >> len;
+        *out++ = toBigEndian(acc);
+
+        free = 64 - len;
+        acc = len ? code << free : 0;
+    }
+
+    // Stores the last partial word, valid only when no other writer shares it
+    void finish() {
+        if (free < 64)
+            *out = toBigEndian(acc);
+    }
+
+    // Number of bits written so far from the beginning of 'words'
+    uint64_t position(const uint64_t* words) const {
+        return (out - words) * 64 + (64 - free);
+    }
+
+    // Returns the last partial word without storing it
+    BitTail tail() const {
+        return {out, free < 64 ? toBigEndian(acc) : 0};
+    }
+};
+
+inline void encodeSymbolsScalar(const char* from, const char* to, const CodeTable& table, BitWriter& writer) {
+    for (; from < to; ++from) {
+        const Code& c = table[static_cast<unsigned char>(*from)];
+        writer.put(c.bits, c.len);
+    }
+}
+
+/* Vectorized encoding, for code tables with codes of at most 32 bits: the codes and lengths
+    of a block of symbols are looked up, then adjacent codes are merged pairwise in wider
+    lanes, each shifted left by the length of the one following it, so that the writer gets
+    a single put() per group of 2 codes, or per group of 4 whenever they fit in a word. No
+    gathers are used, being slower than scalar loads on current cores: AVX-512 looks up 64
+    symbols at a time in byte tables held in registers through the VBMI permutes, AVX2
+    loads 8 symbols one by one from the table. With codes of at most 16 bits, AVX-512 also
+    merges from 16-bit lanes, where every group of 4 fits in a word. Tables with longer codes
+    are encoded by the scalar loop. One binary runs on every host: the kernel is chosen at
+    run time among those supported by the CPU, and HUF_SIMD=scalar|avx2 can force a lower one */
+
+enum EncodeIsa { ENCODE_SCALAR, ENCODE_AVX2, ENCODE_AVX512 };
+
+inline const char* const ENCODE_ISA_NAMES[] = {"scalar", "avx2", "avx512"};
+
+inline unsigned longestCode(const CodeTable& table) {
+    unsigned len = 0;
+    for (const Code& c : table)
+        len = std::max(len, c.len);
+
+    return len;
+}
+
+#ifdef HUF_X86
+
+// The intrinsics leaving lanes undefined upset -Wuninitialized and -Wmaybe-uninitialized in GCC 12
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// Writes 4 pairs of codes, merging them into 2 groups of 4 when both fit in a word
+__attribute__((target("avx2")))
+inline void putPairs(const __m256i code, const __m256i len, BitWriter& writer) {
+    alignas(32) uint64_t words[4], lens[4];
+
+    // Even lanes followed by the odd ones
+    __m256i nextLen = _mm256_unpackhi_epi64(len, len);
+    __m256i total = _mm256_add_epi64(len, nextLen);
+    if (_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(total, _mm256_set1_epi64x(64)))) & 0b0101) {
+        _mm256_store_si256(reinterpret_cast<__m256i*>(words), code);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lens), len);
+        for (int g = 0; g < 4; ++g)
+            writer.put(words[g], lens[g]);
+        return;
+    }
+
+    __m256i merged = _mm256_or_si256(_mm256_sllv_epi64(code, nextLen), _mm256_unpackhi_epi64(code, code));
+    _mm256_store_si256(reinterpret_cast<__m256i*>(words), merged);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lens), total);
+    writer.put(words[0], lens[0]);
+    writer.put(words[2], lens[2]);
+}
+
+__attribute__((target("avx2")))
+inline void encodeSymbolsAvx2(const char* from, const char* to, const CodeTable& table, BitWriter& writer) {
+    if (longestCode(table) > 32) {
+        encodeSymbolsScalar(from, to, table, writer);
+        return;
+    }
+
+    uint32_t codes[256], lengths[256];
+    for (unsigned sym = 0; sym < 256; ++sym) {
+        codes[sym] = table[sym].bits;
+        lengths[sym] = table[sym].len;
+    }
+
+    alignas(32) uint32_t code32[8], len32[8];
+    const __m256i low32 = _mm256_set1_epi64x(0xffffffff);
+
+    for (; to - from >= 8; from += 8) {
+        for (int k = 0; k < 8; ++k) {
+            unsigned char sym = from[k];
+            code32[k] = codes[sym];
+            len32[k] = lengths[sym];
+        }
+
+        __m256i code = _mm256_load_si256(reinterpret_cast<const __m256i*>(code32));
+        __m256i len = _mm256_load_si256(reinterpret_cast<const __m256i*>(len32));
+
+        __m256i next = _mm256_srli_epi64(len, 32);
+        code = _mm256_or_si256(_mm256_sllv_epi64(_mm256_and_si256(code, low32), next), _mm256_srli_epi64(code, 32));
+        len = _mm256_add_epi64(_mm256_and_si256(len, low32), next);
+        putPairs(code, len, writer);
+    }
+
+    encodeSymbolsScalar(from, to, table, writer);
+}
+
+// Byte 'idx' of a 256-byte table held in four registers
+__attribute__((target("avx512f,avx512bw,avx512vbmi")))
+inline __m512i lookupBytes(const __m512i* table, const __m512i idx) {
+    __m512i low = _mm512_permutex2var_epi8(table[0], idx, table[1]);
+    __m512i high = _mm512_permutex2var_epi8(table[2], idx, table[3]);
+    return _mm512_mask_blend_epi8(_mm512_movepi8_mask(idx), low, high);
+}
+
+// 256-byte tables of the lengths and of the first 'codeBytes' bytes of the codes
+template <int codeBytes>
+__attribute__((target("avx512f")))
+inline void loadByteTables(const CodeTable& table, __m512i (*tables)[4]) {
+    alignas(64) uint8_t bytes[codeBytes + 1][256];
+    for (unsigned sym = 0; sym < 256; ++sym) {
+        bytes[0][sym] = table[sym].len;
+        for (int b = 0; b < codeBytes; ++b)
+            bytes[b + 1][sym] = table[sym].bits >> 8 * b;
+    }
+
+    for (int t = 0; t <= codeBytes; ++t)
+        for (int k = 0; k < 4; ++k)
+            tables[t][k] = _mm512_load_si512(bytes[t] + 64 * k);
+}
+
+// Writes 8 pairs of codes, merging them into 4 groups of 4 when all of them fit in a word
+__attribute__((target("avx512f")))
+inline void putPairs(const __m512i code, const __m512i len, BitWriter& writer) {
+    alignas(64) uint64_t words[8], lens[8];
+
+    __m512i nextLen = _mm512_unpackhi_epi64(len, len);
+    __m512i total = _mm512_add_epi64(len, nextLen);
+    if (_mm512_cmpgt_epu64_mask(total, _mm512_set1_epi64(64)) & 0b01010101) {
+        _mm512_store_si512(words, code);
+        _mm512_store_si512(lens, len);
+        for (int g = 0; g < 8; ++g)
+            writer.put(words[g], lens[g]);
+        return;
+    }
+
+    _mm512_store_si512(words, _mm512_or_si512(_mm512_sllv_epi64(code, nextLen), _mm512_unpackhi_epi64(code, code)));
+    _mm512_store_si512(lens, total);
+    for (int g = 0; g < 8; g += 2)
+        writer.put(words[g], lens[g]);
+}
+
+// Merges the 16 codes of quarter 'q' of a block, of up to 32 bits and given as their bytes, into pairs
+template <int q>
+__attribute__((target("avx512f")))
+inline void encodeQuarter(const __m512i len8, const __m512i* code8, BitWriter& writer) {
+    const __m512i low32 = _mm512_set1_epi64(0xffffffff);
+
+    __m512i len = _mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(len8, q));
+    __m512i code = _mm512_setzero_si512();
+    for (int b = 0; b < 4; ++b)
+        code = _mm512_or_si512(code, _mm512_slli_epi32(_mm512_cvtepu8_epi32(_mm512_extracti32x4_epi32(code8[b], q)), 8 * b));
+
+    __m512i next = _mm512_srli_epi64(len, 32);
+    code = _mm512_or_si512(_mm512_sllv_epi64(_mm512_and_si512(code, low32), next), _mm512_srli_epi64(code, 32));
+    len = _mm512_add_epi64(_mm512_and_si512(len, low32), next);
+    putPairs(code, len, writer);
+}
+
+// Merges 32 codes of up to 16 bits, given as their bytes, into 8 groups of 4
+__attribute__((target("avx512f,avx512bw")))
+inline void encodeHalf(const __m256i len8, const __m256i low8, const __m256i high8, BitWriter& writer) {
+    const __m512i low16 = _mm512_set1_epi32(0xffff);
+    const __m512i low32 = _mm512_set1_epi64(0xffffffff);
+    alignas(64) uint64_t words[8], lens[8];
+
+    __m512i len = _mm512_cvtepu8_epi16(len8);
+    __m512i code = _mm512_or_si512(_mm512_cvtepu8_epi16(low8), _mm512_slli_epi16(_mm512_cvtepu8_epi16(high8), 8));
+
+    __m512i next = _mm512_srli_epi32(len, 16);
+    code = _mm512_or_si512(_mm512_sllv_epi32(_mm512_and_si512(code, low16), next), _mm512_srli_epi32(code, 16));
+    len = _mm512_add_epi32(_mm512_and_si512(len, low16), next);
+
+    next = _mm512_srli_epi64(len, 32);
+    code = _mm512_or_si512(_mm512_sllv_epi64(_mm512_and_si512(code, low32), next), _mm512_srli_epi64(code, 32));
+    len = _mm512_add_epi64(_mm512_and_si512(len, low32), next);
+
+    _mm512_store_si512(words, code);
+    _mm512_store_si512(lens, len);
+    for (int g = 0; g < 8; ++g)
+        writer.put(words[g], lens[g]);
+}
+
+__attribute__((target("avx2,avx512f,avx512bw,avx512vbmi")))
+inline void encodeSymbolsAvx512(const char* from, const char* to, const CodeTable& table, BitWriter& writer) {
+    unsigned longest = longestCode(table);
+    if (longest > 32) {
+        encodeSymbolsScalar(from, to, table, writer);
+        return;
+    }
+
+    __m512i tables[5][4];
+
+    if (longest <= 16) {
+        loadByteTables<2>(table, tables);
+        for (; to - from >= 64; from += 64) {
+            __m512i idx = _mm512_loadu_si512(from);
+            __m512i len = lookupBytes(tables[0], idx);
+            __m512i low = lookupBytes(tables[1], idx);
+            __m512i high = lookupBytes(tables[2], idx);
+
+            encodeHalf(_mm512_castsi512_si256(len), _mm512_castsi512_si256(low), _mm512_castsi512_si256(high), writer);
+            encodeHalf(
+                _mm512_extracti64x4_epi64(len, 1), _mm512_extracti64x4_epi64(low, 1), _mm512_extracti64x4_epi64(high, 1),
+                writer
+            );
+        }
+    } else {
+        loadByteTables<4>(table, tables);
+        for (; to - from >= 64; from += 64) {
+            __m512i idx = _mm512_loadu_si512(from);
+            __m512i len = lookupBytes(tables[0], idx);
+            __m512i code[4];
+            for (int b = 0; b < 4; ++b)
+                code[b] = lookupBytes(tables[b + 1], idx);
+
+            encodeQuarter<0>(len, code, writer);
+            encodeQuarter<1>(len, code, writer);
+            encodeQuarter<2>(len, code, writer);
+            encodeQuarter<3>(len, code, writer);
+        }
+    }
+
+    encodeSymbolsAvx2(from, to, table, writer);
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+// The best kernel supported by the CPU, unless HUF_SIMD asks for a lower one
+inline EncodeIsa detectEncodeIsa() {
+    EncodeIsa isa = ENCODE_SCALAR;
+#ifdef HUF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        isa = __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi") ? ENCODE_AVX512 : ENCODE_AVX2;
+#endif
+
+    const char* cap = getenv("HUF_SIMD");
+    if (cap)
+        for (int i = ENCODE_SCALAR; i < isa; ++i)
+            if (std::strcmp(cap, ENCODE_ISA_NAMES[i]) == 0)
+                isa = static_cast<EncodeIsa>(i);
+
+    return isa;
+}
+
+inline EncodeIsa encodeIsa() {
+    static const EncodeIsa isa = detectEncodeIsa();
+    return isa;
+}
+
+inline void encodeSymbols(const char* from, const char* to, const CodeTable& table, BitWriter& writer) {
+#ifdef HUF_X86
+    switch (encodeIsa()) {
+    case ENCODE_AVX512:
+        encodeSymbolsAvx512(from, to, table, writer);
+        return;
+    case ENCODE_AVX2:
+        encodeSymbolsAvx2(from, to, table, writer);
+        return;
+    default:
+        break;
+    }
+#endif
+
+    encodeSymbolsScalar(from, to, table, writer);
+}
+
+// Exact number of bits produced by encoding a chunk with the given histogram
+inline uint64_t encodedBits(const Histogram& histogram, const CodeTable& table) {
+    uint64_t bits = 0;
+    for (unsigned sym = 0; sym < histogram.size(); ++sym)
+        bits += histogram[sym] * table[sym].len;
+
+    return bits;
+}
+
+// Merges the tail of a writer once the writer of the next chunk, sharing its word, is done
+inline void mergeTail(const BitTail& tail) {
+    if (tail.word)
+        *tail.pos |= tail.word;
+}
+
+// Merges the tails of writers which encoded adjacent chunks, once all of them are done
+inline void mergeTails(const std::vector<BitTail>& tails) {
+    for (const BitTail& tail : tails)
+        mergeTail(tail);
+}
+
+/* Reads a packed bitstream through a left-aligned 64-bit window, refilled with
+    one unaligned big-endian load when enough input is left */
+class BitReader {
+    const uint8_t* next;
+    const uint8_t* end;
+    uint64_t window;
+    unsigned avail; // Valid bits at the top of window
+    uint64_t padded; // Zero bytes loaded past the end
+
+public:
+    BitReader(const char* data, uint64_t byteSize, uint64_t bitOffset) :
+        next(reinterpret_cast<const uint8_t*>(data) + bitOffset / 8),
+        end(reinterpret_cast<const uint8_t*>(data) + byteSize),
+        window(0),
+        avail(0),
+        padded(0)
+    {
+        refill();
+        consume(bitOffset % 8);
+    }
+
+    // Guarantees at least 56 valid bits, padding with zeros past the end
+    inline void refill() {
+        if (end - next >= 8) {
+            uint64_t w;
+            std::memcpy(&w, next, 8);
+            window |= fromBigEndian(w) >> avail;
+            next += (63 - avail) >> 3;
+            avail |= 56;
+        } else {
+            while (avail <= 56) {
+                if (next < end)
+                    window |= static_cast<uint64_t>(*next++) << (56 - avail);
+                else
+                    ++padded;
+                avail += 8;
+            }
+        }
+    }
+
+    // Requires 1 <= n <= avail
+    inline uint64_t peek(unsigned n) const { return window >> (64 - n); }
+
+    inline void consume(unsigned n) {
+        window <<= n;
+        avail -= n;
+    }
+
+    // Number of bits consumed so far from the beginning of 'data'
+    uint64_t position(const char* data) const {
+        return (next - reinterpret_cast<const uint8_t*>(data) + padded) * 8 - avail;
+    }
+};
+
+#endif
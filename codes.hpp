@@ -0,0 +1,219 @@
+#ifndef CODES_H
+#define CODES_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "bitstream.hpp"
+
+/* Canonical Huffman codes: only the length of each symbol's code is computed, then
+    codes are assigned in (length, symbol) order, each one being the previous code
+    plus one, shifted left whenever the length grows. The lengths alone describe the
+    whole code, regardless of how ties were broken while computing them */
+
+constexpr unsigned MAX_CODE_LENGTH = 64;
+
+// Code length of every byte value, 0 for symbols which do not occur
+using CodeLengths = std::array<uint8_t, 256>;
+
+/* Checks that the lengths can be assigned prefix-free codes (Kraft inequality):
+    'available' counts the unused codes of the current length, and once it exceeds
+    the number of symbols it can no longer be exhausted */
+inline bool validLengths(const CodeLengths& lengths) {
+    std::array<unsigned, MAX_CODE_LENGTH + 1> count{};
+    for (const uint8_t len : lengths) {
+        if (len > MAX_CODE_LENGTH)
+            return false;
+        ++count[len];
+    }
+
+    uint64_t available = 1;
+    for (unsigned len = 1; len <= MAX_CODE_LENGTH && available <= lengths.size(); ++len) {
+        available *= 2;
+        if (available < count[len])
+            return false;
+        available -= count[len];
+    }
+
+    return true;
+}
+
+inline unsigned maxCodeLength(const CodeLengths& lengths) {
+    return *std::max_element(lengths.begin(), lengths.end());
+}
+
+// Indices of the symbols by increasing frequency, ties broken by symbol to keep the result deterministic
+inline void sortByFrequency(
+    const std::vector<char>& symbols,
+    const std::vector<uint64_t>& freqs,
+    std::array<uint16_t, 256>& order
+) {
+    for (uint16_t i = 0; i < symbols.size(); ++i)
+        order[i] = i;
+
+    std::sort(order.begin(), order.begin() + symbols.size(), [&](uint16_t a, uint16_t b) {
+        if (freqs[a] != freqs[b])
+            return freqs[a] < freqs[b];
+        return static_cast<unsigned char>(symbols[a]) < static_cast<unsigned char>(symbols[b]);
+    });
+}
+
+/* Huffman code lengths computed in place over the sorted frequencies (Moffat and Katajainen).
+    The first pass builds the tree left to right, using the array both for the weights of the
+    internal nodes still to be paired and for the parent pointers of the paired ones; the second
+    one turns parent pointers into depths of the internal nodes; the third one assigns leaf
+    depths, right to left, with the nodes available at each depth left unused by internal ones */
+inline CodeLengths huffmanCodeLengths(const std::vector<char>& symbols, const std::vector<uint64_t>& freqs) {
+    CodeLengths lengths{};
+    const int n = symbols.size();
+
+    if (n == 0) // Empty input
+        return lengths;
+
+    if (n == 1) {
+        lengths[static_cast<unsigned char>(symbols[0])] = 1;
+        return lengths;
+    }
+
+    std::array<uint16_t, 256> order;
+    sortByFrequency(symbols, freqs, order);
+
+    std::array<uint64_t, 256> a{};
+    for (int i = 0; i < n; ++i)
+        a[i] = freqs[order[i]];
+
+    a[0] += a[1];
+    int root = 0, leaf = 2;
+    for (int next = 1; next < n - 1; ++next) {
+        if (leaf >= n || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root++] = next;
+        } else {
+            a[next] = a[leaf++];
+        }
+
+        if (leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = next;
+        } else {
+            a[next] += a[leaf++];
+        }
+    }
+
+    a[n - 2] = 0;
+    for (int next = n - 3; next >= 0; --next)
+        a[next] = a[a[next]] + 1;
+
+    int available = 1, used = 0, next = n - 1;
+    uint64_t depth = 0;
+    root = n - 2;
+    while (available > 0) {
+        while (root >= 0 && a[root] == depth) {
+            ++used;
+            --root;
+        }
+
+        while (available > used) {
+            a[next--] = depth;
+            --available;
+        }
+
+        available = 2 * used;
+        ++depth;
+        used = 0;
+    }
+
+    for (int i = 0; i < n; ++i)
+        lengths[static_cast<unsigned char>(symbols[order[i]])] = a[i];
+
+    return lengths;
+}
+
+/* Optimal code lengths bounded by 'maxLen' (package-merge). Starting from the deepest
+    level, each list is the sorted merge of the symbols with the pairwise packages of the
+    previous list; the first 2n - 2 items of the last list are the selected coins. Lists
+    are kept as package flags only: the selected leaves of a list are always its first
+    ones, and its selected packages are made of the first items of the list below.
+    A limit too small for the number of symbols is raised to the smallest feasible one */
+inline CodeLengths packageMerge(
+    const std::vector<char>& symbols,
+    const std::vector<uint64_t>& freqs,
+    unsigned maxLen
+) {
+    CodeLengths lengths{};
+    const uint64_t n = symbols.size();
+
+    if (n == 1) {
+        lengths[static_cast<unsigned char>(symbols[0])] = 1;
+        return lengths;
+    }
+
+    while (maxLen < MAX_CODE_LENGTH && (1ull << maxLen) < n)
+        ++maxLen;
+
+    std::array<uint16_t, 256> order;
+    sortByFrequency(symbols, freqs, order);
+
+    std::vector<std::vector<bool>> isPackage(maxLen);
+    std::vector<uint64_t> weights, merged;
+    for (uint64_t i = 0; i < n; ++i)
+        weights.push_back(freqs[order[i]]);
+    isPackage[0].assign(n, false);
+
+    for (unsigned level = 1; level < maxLen; ++level) {
+        merged.clear();
+        uint64_t leaf = 0, package = 0, packages = weights.size() / 2;
+        while (leaf < n || package < packages) {
+            uint64_t p = package < packages ? weights[2 * package] + weights[2 * package + 1] : UINT64_MAX;
+            if (leaf < n && freqs[order[leaf]] <= p) {
+                merged.push_back(freqs[order[leaf++]]);
+                isPackage[level].push_back(false);
+            } else {
+                merged.push_back(p);
+                isPackage[level].push_back(true);
+                ++package;
+            }
+        }
+
+        weights.swap(merged);
+    }
+
+    uint64_t selected = 2 * n - 2;
+    for (int level = maxLen - 1; level >= 0; --level) {
+        uint64_t packages = 0;
+        for (uint64_t k = 0; k < selected; ++k) {
+            if (isPackage[level][k])
+                ++packages;
+            else
+                ++lengths[static_cast<unsigned char>(symbols[order[k - packages]])];
+        }
+
+        selected = 2 * packages;
+    }
+
+    return lengths;
+}
+
+// Requires validLengths(lengths)
+inline CodeTable canonicalCodes(const CodeLengths& lengths) {
+    std::array<uint64_t, MAX_CODE_LENGTH + 2> next{};
+    for (const uint8_t len : lengths)
+        if (len)
+            ++next[len + 1];
+
+    // First code of each length: next[len] = (next[len - 1] + count[len - 1]) << 1
+    next[0] = next[1] = 0;
+    for (unsigned len = 2; len <= MAX_CODE_LENGTH; ++len)
+        next[len] = (next[len - 1] + next[len]) << 1;
+
+    CodeTable table{};
+    for (unsigned sym = 0; sym < lengths.size(); ++sym)
+        if (lengths[sym])
+            table[sym] = {next[lengths[sym]]++, lengths[sym]};
+
+    return table;
+}
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bitstream.hpp"
+#include "codes.hpp"
+#include "decoder.hpp"
+
+/* On-disk layout of a compressed file, all integers little-endian:
+    magic "PHUF" | version u8 | flags u8 | original length u64 | total bits u64 |
+    code table | [block index] | payload of ceil(total bits / 8) bytes
+
+    Code table: 256 code lengths u8, one per byte value (0 if absent); the codes
+    are the canonical ones for these lengths
+
+    Block index (only with FLAG_BLOCK_INDEX): block count u64, then per block:
+    bit offset in the payload u64 | byte offset in the original data u64
+
+    With FLAG_STREAM the container is a frame of a compressed stream, followed by
+    the frames of the next segments of the original data (see stream.hpp) */
+
+constexpr char CONTAINER_MAGIC[4] = {'P', 'H', 'U', 'F'};
+constexpr uint8_t CONTAINER_VERSION = 2;
+constexpr uint8_t FLAG_BLOCK_INDEX = 1;
+constexpr uint8_t FLAG_STREAM = 2;
+
+// Amount of original data between two consecutive sync points of the block index
+constexpr uint64_t BLOCK_SIZE = 256 * 1024;
+
+// Sync point of the bitstream: decoding can start here and produce data from 'byteOffset'
+struct BlockEntry {
+    uint64_t bitOffset;
+    uint64_t byteOffset;
+};
+
+struct ContainerHeader {
+    uint64_t originalLength = 0;
+    uint64_t totalBits = 0;
+    CodeTable codeTable{};
+    std::vector<BlockEntry> blocks;
+    bool streamed = false;
+};
+
+inline void putLE(std::string& out, uint64_t v, unsigned bytes) {
+    for (unsigned i = 0; i < bytes; ++i)
+        out += static_cast<char>((v >> (8 * i)) & 0xff);
+}
+
+inline std::string serializeHeader(const ContainerHeader& header) {
+    std::string out(CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC));
+    putLE(out, CONTAINER_VERSION, 1);
+    putLE(out, (header.blocks.empty() ? 0 : FLAG_BLOCK_INDEX) | (header.streamed ? FLAG_STREAM : 0), 1);
+    putLE(out, header.originalLength, 8);
+    putLE(out, header.totalBits, 8);
+
+    for (const Code& c : header.codeTable)
+        putLE(out, c.len, 1);
+
+    if (!header.blocks.empty()) {
+        putLE(out, header.blocks.size(), 8);
+        for (const auto& [bitOffset, byteOffset] : header.blocks) {
+            putLE(out, bitOffset, 8);
+            putLE(out, byteOffset, 8);
+        }
+    }
+
+    return out;
+}
+
+// Bounds-checked little-endian reads over the serialized header
+class HeaderParser {
+    const char* data;
+    uint64_t size;
+    uint64_t pos;
+
+public:
+    HeaderParser(const char* data, uint64_t size) : data(data), size(size), pos(0) {}
+
+    bool get(uint64_t& v, unsigned bytes) {
+        if (size - pos < bytes)
+            return false;
+
+        v = 0;
+        for (unsigned i = 0; i < bytes; ++i)
+            v |= static_cast<uint64_t>(static_cast<uint8_t>(data[pos + i])) << (8 * i);
+        pos += bytes;
+
+        return true;
+    }
+
+    uint64_t position() const { return pos; }
+};
+
+// Parses the header at the beginning of 'data', returning the offset of the payload through 'payloadOffset'
+inline bool parseHeader(const char* data, uint64_t size, ContainerHeader& header, uint64_t& payloadOffset) {
+    if (size < sizeof(CONTAINER_MAGIC) || std::memcmp(data, CONTAINER_MAGIC, sizeof(CONTAINER_MAGIC))) {
+        std::cerr << "Not a compressed file" << std::endl;
+        return false;
+    }
+
+    HeaderParser p(data + sizeof(CONTAINER_MAGIC), size - sizeof(CONTAINER_MAGIC));
+
+    uint64_t version, flags, count, len = 0;
+    if (!p.get(version, 1) || version != CONTAINER_VERSION) {
+        std::cerr << "Unsupported compressed file version" << std::endl;
+        return false;
+    }
+
+    bool ok = p.get(flags, 1) && p.get(header.originalLength, 8) && p.get(header.totalBits, 8);
+
+    CodeLengths lengths{};
+    for (unsigned sym = 0; ok && sym < lengths.size(); ++sym) {
+        ok = p.get(len, 1);
+        lengths[sym] = static_cast<uint8_t>(len);
+    }
+
+    header.streamed = ok && (flags & FLAG_STREAM);
+
+    ok = ok && validLengths(lengths);
+    if (ok)
+        header.codeTable = canonicalCodes(lengths);
+
+    header.blocks.clear();
+    if (ok && (flags & FLAG_BLOCK_INDEX)) {
+        ok = p.get(count, 8) && count <= size / 16;
+        for (uint64_t i = 0; ok && i < count; ++i) {
+            BlockEntry b;
+            ok = p.get(b.bitOffset, 8) && p.get(b.byteOffset, 8);
+            header.blocks.push_back(b);
+        }
+
+        // Sync points must start at 0 and split the original data in increasing, non-empty blocks
+        for (uint64_t i = 0; ok && i < header.blocks.size(); ++i) {
+            const BlockEntry& b = header.blocks[i];
+            ok = b.bitOffset <= header.totalBits && b.byteOffset < header.originalLength &&
+                (i ? b.byteOffset > header.blocks[i - 1].byteOffset : b.byteOffset == 0);
+        }
+    }
+
+    /* Every symbol takes from 1 to MAX_CODE_LENGTH bits, and the payload holds all of them,
+        which bounds the sizes read from the header before anything is allocated for them */
+    payloadOffset = sizeof(CONTAINER_MAGIC) + p.position();
+    ok = ok && header.totalBits <= (size - payloadOffset) * 8 &&
+        header.originalLength <= header.totalBits && header.totalBits / MAX_CODE_LENGTH <= header.originalLength;
+    if (!ok) {
+        std::cerr << "Truncated or corrupted compressed file" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Parses the header of a whole compressed file already in memory, refusing streamed ones
+inline bool parseContainer(const char* data, const uint64_t size, ContainerHeader& header, uint64_t& payloadOffset) {
+    if (!parseHeader(data, size, header, payloadOffset))
+        return false;
+
+    if (header.streamed) {
+        std::cerr << "Compressed in streaming mode, decompress it in streaming mode" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Reads a whole compressed file, keeping the payload at 'payloadOffset' of 'contents'
+inline bool readContainer(
+    const std::string& filename,
+    ContainerHeader& header,
+    std::string& contents,
+    uint64_t& payloadOffset
+) {
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+
+    if (!file.is_open()) {
+        std::cerr << "Could not open the file" << std::endl;
+        return false;
+    }
+
+    contents.resize(file.tellg());
+    file.seekg(0);
+    file.read(contents.data(), contents.size());
+    file.close();
+
+    return parseContainer(contents.data(), contents.size(), header, payloadOffset);
+}
+
+inline uint64_t blockCount(uint64_t length) {
+    return (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/* Encodes text[from, to), recording in 'blocks' the sync point of every block 
+    starting inside the range; 'words' is the start of the whole output */
+inline void encodeBlocks(
+    const char* text,
+    uint64_t from,
+    const uint64_t to,
+    const CodeTable& table,
+    BitWriter& writer,
+    const uint64_t* words,
+    std::vector<BlockEntry>& blocks
+) {
+    while (from < to) {
+        uint64_t next = std::min(to, (from / BLOCK_SIZE + 1) * BLOCK_SIZE);
+        if (from % BLOCK_SIZE == 0)
+            blocks[from / BLOCK_SIZE] = {writer.position(words), from};
+
+        encodeSymbols(text + from, text + next, table, writer);
+        from = next;
+    }
+}
+
+// Decodes blocks [first, last) of the payload into their positions of 'out'
+inline void decodeBlocks(
+    const char* payload,
+    const ContainerHeader& header,
+    const DecodeTable& decodeTable,
+    char* out,
+    const uint64_t first,
+    const uint64_t last
+) {
+    for (uint64_t k = first; k < last; ++k) {
+        uint64_t from = header.blocks[k].byteOffset;
+        uint64_t to = k + 1 < header.blocks.size() ? header.blocks[k + 1].byteOffset : header.originalLength;
+
+        BitReader reader(payload, (header.totalBits + 7) / 8, header.blocks[k].bitOffset);
+        decodeSymbols(decodeTable, reader, out + from, to - from);
+    }
+}
+
+#endif
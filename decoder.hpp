@@ -0,0 +1,135 @@
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "bitstream.hpp"
+
+/* Entry of a lookup table: a leaf holds the decoded symbol in 'next' and the bits it
+    takes at this level in 'len'; otherwise 'next' is the offset of the subtable indexed
+    by the following 'subBits' bits, after consuming the 'len' bits of this level */
+struct DecodeEntry {
+    uint32_t next;
+    uint8_t len;
+    uint8_t subBits;
+};
+
+/* Multi-level lookup table: the root is indexed by the first (up to) LOOKUP_BITS bits
+    of the stream, codes longer than that continue into subtables */
+class DecodeTable {
+    struct Suffix {
+        uint64_t bits;
+        unsigned len;
+        unsigned sym;
+    };
+
+    std::pair<uint32_t, unsigned> buildLevel(const std::vector<Suffix>& codes) {
+        unsigned levelMax = 1;
+        for (const auto& c : codes)
+            levelMax = std::max(levelMax, c.len);
+        unsigned bits = std::min(levelMax, LOOKUP_BITS);
+
+        uint32_t base = entries.size();
+        entries.resize(base + (1u << bits), {0, 0, 0});
+
+        std::vector<std::vector<Suffix>> longer(1u << bits);
+        for (const auto& c : codes) {
+            if (c.len <= bits) {
+                uint32_t first = base + (c.bits << (bits - c.len));
+                uint32_t count = 1u << (bits - c.len);
+                std::fill_n(entries.begin() + first, count, DecodeEntry{c.sym, static_cast<uint8_t>(c.len), 0});
+            } else {
+                unsigned rest = c.len - bits;
+                longer[c.bits >> rest].push_back({c.bits & ((1ull << rest) - 1), rest, c.sym});
+            }
+        }
+
+        for (uint32_t prefix = 0; prefix < longer.size(); ++prefix) {
+            if (longer[prefix].empty())
+                continue;
+
+            auto [offset, subBits] = buildLevel(longer[prefix]);
+            entries[base + prefix] = {offset, static_cast<uint8_t>(bits), static_cast<uint8_t>(subBits)};
+        }
+
+        return {base, bits};
+    }
+
+public:
+    static constexpr unsigned LOOKUP_BITS = 11;
+
+    std::vector<DecodeEntry> entries;
+    unsigned rootBits;
+    unsigned maxLen;
+
+    explicit DecodeTable(const CodeTable& codeTable) : maxLen(0) {
+        std::vector<Suffix> codes;
+        for (unsigned sym = 0; sym < codeTable.size(); ++sym) {
+            if (codeTable[sym].len) {
+                codes.push_back({codeTable[sym].bits, codeTable[sym].len, sym});
+                maxLen = std::max(maxLen, codeTable[sym].len);
+            }
+        }
+
+        rootBits = buildLevel(codes).second;
+    }
+};
+
+// Decodes a single symbol, following subtables for codes longer than the root
+inline unsigned decodeSymbol(const DecodeEntry* entries, const unsigned rootBits, BitReader& reader) {
+    const DecodeEntry* e = &entries[reader.peek(rootBits)];
+    while (e->subBits) {
+        reader.consume(e->len);
+        reader.refill();
+        e = &entries[e->next + reader.peek(e->subBits)];
+    }
+    reader.consume(e->len);
+
+    return e->next;
+}
+
+/* As decodeSymbol(), but returns -1 without consuming the bits when they fall in an unused
+    slot of the table, left by an incomplete code for the bit patterns matching no code */
+inline int decodeSymbolChecked(const DecodeEntry* entries, const unsigned rootBits, BitReader& reader) {
+    const DecodeEntry* e = &entries[reader.peek(rootBits)];
+    while (e->subBits) {
+        reader.consume(e->len);
+        reader.refill();
+        e = &entries[e->next + reader.peek(e->subBits)];
+    }
+
+    if (!e->len)
+        return -1;
+    reader.consume(e->len);
+
+    return e->next;
+}
+
+/* Decodes 'count' symbols into 'out' from the given reader. Subtables refill the
+    window by themselves, so every refill is good for a root lookup per rootBits bits.
+    The reader and the table are copied to locals since stores through 'out' may alias them */
+inline void decodeSymbols(const DecodeTable& table, BitReader& reader, char* out, uint64_t count) {
+    char* const end = out + count;
+    const DecodeEntry* entries = table.entries.data();
+    const unsigned rootBits = table.rootBits;
+    const uint64_t perRefill = 56 / rootBits;
+
+    BitReader local = reader;
+
+    while (static_cast<uint64_t>(end - out) >= perRefill) {
+        local.refill();
+        for (uint64_t k = 0; k < perRefill; ++k)
+            *out++ = static_cast<char>(decodeSymbol(entries, rootBits, local));
+    }
+
+    while (out < end) {
+        local.refill();
+        *out++ = static_cast<char>(decodeSymbol(entries, rootBits, local));
+    }
+
+    reader = local;
+}
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "trace.hpp"
+
+// Occurrences of every byte value
+using Histogram = std::array<uint64_t, 256>;
+
+inline void addHistogram(Histogram& into, const Histogram& from) {
+    for (unsigned k = 0; k < into.size(); ++k)
+        into[k] += from[k];
+}
+
+// Symbols occurring in the histogram with their frequencies, by increasing byte value
+inline void populateSymbolsAndFrequencies(
+    const Histogram& histogram, 
+    std::vector<char>& symbols, 
+    std::vector<uint64_t>& freqs
+) {
+    for (unsigned sym = 0; sym < histogram.size(); ++sym) {
+        if (histogram[sym]) {
+            symbols.push_back(static_cast<char>(sym));
+            freqs.push_back(histogram[sym]);
+        }
+    }
+}
+
+/* Adds the bytes of [from, to) to 'hist'. Bytes are counted in 4 interleaved sub-histograms,
+    so that runs of the same byte do not serialize on the increment of a single counter */
+inline void countSymbols(const char* from, const char* to, Histogram& hist) {
+    std::array<Histogram, 4> lanes{};
+
+    for (; to - from >= 8; from += 8) {
+        uint64_t w;
+        std::memcpy(&w, from, 8);
+
+        ++lanes[0][w & 0xff];
+        ++lanes[1][(w >> 8) & 0xff];
+        ++lanes[2][(w >> 16) & 0xff];
+        ++lanes[3][(w >> 24) & 0xff];
+        ++lanes[0][(w >> 32) & 0xff];
+        ++lanes[1][(w >> 40) & 0xff];
+        ++lanes[2][(w >> 48) & 0xff];
+        ++lanes[3][w >> 56];
+    }
+
+    for (; from < to; ++from)
+        ++lanes[0][static_cast<unsigned char>(*from)];
+
+    for (const Histogram& lane : lanes)
+        addHistogram(hist, lane);
+}
+
+/* Lock-free tree reduction of the per-chunk histograms of nw workers: worker i adds the
+    sums of workers i + 1, i + 2, i + 4, ... for as long as i is a multiple of twice the
+    step, waiting for each of them to publish its own sum, so that worker 0 ends with
+    the total after log2(nw) additions */
+class HistogramTree {
+    std::vector<Histogram> sums;
+    std::unique_ptr<std::atomic<bool>[]> ready;
+    int nw;
+
+public:
+    explicit HistogramTree(int nw) : sums(nw), ready(new std::atomic<bool>[nw]), nw(nw) {
+        for (int i = 0; i < nw; ++i)
+            ready[i].store(false, std::memory_order_relaxed);
+    }
+
+    // Called once by every worker with the histogram of its chunk
+    void reduce(const Histogram& hist, const int i) {
+        TRACE_SPAN("reduce")
+        sums[i] = hist;
+
+        for (int step = 1; i % (2 * step) == 0 && i + step < nw; step *= 2) {
+            ready[i + step].wait(false, std::memory_order_acquire);
+            addHistogram(sums[i], sums[i + step]);
+        }
+
+        ready[i].store(true, std::memory_order_release);
+        ready[i].notify_one();
+    }
+
+    // Valid once all the workers returned from reduce()
+    const Histogram& total() const { return sums[0]; }
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Read-only memory mapping of a whole input file: workers read their chunks straight
+    from the page cache, with no copy and no per-character stream extraction */
+class MappedFile {
+    const char* data;
+    uint64_t size;
+
+public:
+    MappedFile() : data(nullptr), size(0) {}
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data)
+            munmap(const_cast<char*>(data), size);
+    }
+
+    bool open(const std::string& filename) {
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Could not open the file" << std::endl;
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            std::cerr << "Could not open the file" << std::endl;
+            close(fd);
+            return false;
+        }
+
+        size = st.st_size;
+        if (!size) { // Nothing to map
+            close(fd);
+            return true;
+        }
+
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd); // The mapping keeps the file referenced
+
+        if (p == MAP_FAILED) {
+            std::cerr << "Could not map the file" << std::endl;
+            size = 0;
+            return false;
+        }
+
+        /* Hints only: each chunk is scanned from start to end, and readahead can start at once;
+            pages are faulted in by the workers touching their own chunks */
+        madvise(p, size, MADV_SEQUENTIAL);
+        madvise(p, size, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+
+        data = static_cast<const char*>(p);
+        return true;
+    }
+
+    std::string_view view() const { return {data, size}; }
+};
+
+#endif
@@ -0,0 +1,305 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Live progress of long runs, enabled by the HUF_METRICS environment variable: the workers
+    add to lock-free counters as they complete their chunks, and an exporter thread publishes
+    them every HUF_METRICS_INTERVAL msecs (1000 by default) in the Prometheus text format,
+    either rewriting the file named by HUF_METRICS or, when it is "unix:<path>", answering
+    every connection to a Unix socket at <path> with the latest snapshot */
+
+enum MetricsCounter { BYTES_READ, BYTES_ENCODED, BYTES_WRITTEN, BYTES_DECODED, METRICS_COUNTERS };
+
+inline const char* const METRICS_NAMES[METRICS_COUNTERS] = {"read", "encoded", "written", "decoded"};
+
+// Workers whose busy time is tracked, by index
+constexpr int METRICS_MAX_WORKERS = 1024;
+
+class Metrics {
+    // Each on its own cache line, as they are updated by different workers
+    struct alignas(64) Counter {
+        std::atomic<uint64_t> value{0};
+    };
+
+    std::array<Counter, METRICS_COUNTERS> counters;
+    std::unique_ptr<Counter[]> busy; // Usecs per worker
+    std::atomic<int> workers;
+    std::atomic<const char*> phase;
+
+    const std::chrono::steady_clock::time_point origin;
+    std::string path;
+    bool socketMode;
+    int listenFd;
+    int stopPipe[2];
+    std::thread exporter;
+
+    // State of the exporter thread only
+    std::array<uint64_t, METRICS_COUNTERS> lastValues{};
+    std::unique_ptr<long[]> lastBusy;
+    double lastTime = 0;
+    double lastProgress; // Unix time of the last change of any counter
+    std::string snapshot;
+
+    static double unixTime() {
+        return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void update() {
+        double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - origin).count();
+        double interval = std::max(1e-6, now - lastTime);
+
+        std::ostringstream os;
+        os << std::fixed << std::setprecision(3);
+
+        std::array<uint64_t, METRICS_COUNTERS> values;
+        bool progress = false;
+        for (int c = 0; c < METRICS_COUNTERS; ++c) {
+            values[c] = counters[c].value.load(std::memory_order_relaxed);
+            progress = progress || values[c] != lastValues[c];
+        }
+        if (progress)
+            lastProgress = unixTime();
+
+        os << "# HELP huf_bytes_total Bytes processed so far, by stage\n# TYPE huf_bytes_total counter\n";
+        for (int c = 0; c < METRICS_COUNTERS; ++c)
+            os << "huf_bytes_total{stage=\"" << METRICS_NAMES[c] << "\"} " << values[c] << "\n";
+
+        os << "# HELP huf_throughput_bytes_per_second Bytes processed per second over the last interval, by stage\n"
+            "# TYPE huf_throughput_bytes_per_second gauge\n";
+        for (int c = 0; c < METRICS_COUNTERS; ++c)
+            os << "huf_throughput_bytes_per_second{stage=\"" << METRICS_NAMES[c] << "\"} " << (values[c] - lastValues[c]) / interval << "\n";
+
+        // Busy time is added when a task completes, hence the ratio over an interval is capped to 1
+        int nw = workers.load(std::memory_order_relaxed);
+        os << "# HELP huf_worker_busy_seconds_total Time spent by each worker running tasks\n"
+            "# TYPE huf_worker_busy_seconds_total counter\n";
+        for (int i = 0; i < nw; ++i)
+            os << "huf_worker_busy_seconds_total{worker=\"" << i << "\"} " << busy[i].value.load(std::memory_order_relaxed) / 1e6 << "\n";
+
+        os << "# HELP huf_worker_busy_ratio Fraction of the last interval spent by each worker running tasks\n"
+            "# TYPE huf_worker_busy_ratio gauge\n";
+        for (int i = 0; i < nw; ++i) {
+            long b = busy[i].value.load(std::memory_order_relaxed);
+            os << "huf_worker_busy_ratio{worker=\"" << i << "\"} " << std::min(1.0, (b - lastBusy[i]) / 1e6 / interval) << "\n";
+            lastBusy[i] = b;
+        }
+
+        os << "# HELP huf_phase Phase currently running\n# TYPE huf_phase gauge\n"
+            "huf_phase{phase=\"" << phase.load(std::memory_order_relaxed) << "\"} 1\n";
+        os << "# HELP huf_elapsed_seconds Time since the start of the run\n# TYPE huf_elapsed_seconds gauge\n"
+            "huf_elapsed_seconds " << now << "\n";
+        os << "# HELP huf_last_progress_timestamp_seconds Unix time of the last bytes processed, for detecting stalls\n"
+            "# TYPE huf_last_progress_timestamp_seconds gauge\n"
+            "huf_last_progress_timestamp_seconds " << lastProgress << "\n";
+
+        snapshot = os.str();
+        lastValues = values;
+        lastTime = now;
+
+        if (!socketMode)
+            writeFile();
+    }
+
+    // Replaced atomically, so that a reader never sees a partial snapshot
+    void writeFile() {
+        std::string tmp = path + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return;
+
+        bool ok = write(fd, snapshot.data(), snapshot.size()) == static_cast<ssize_t>(snapshot.size());
+        close(fd);
+
+        if (ok)
+            rename(tmp.c_str(), path.c_str());
+    }
+
+    void serve(const int fd) {
+        uint64_t sent = 0;
+        while (sent < snapshot.size()) {
+            ssize_t n = send(fd, snapshot.data() + sent, snapshot.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+
+        close(fd);
+    }
+
+    void run(const int intervalMs) {
+        auto next = std::chrono::steady_clock::now();
+
+        while (true) {
+            update();
+            next += std::chrono::milliseconds(intervalMs);
+
+            // Connections are answered until the next update, or until the destructor writes to the pipe
+            while (true) {
+                long wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()).count();
+                if (wait <= 0)
+                    break;
+
+                pollfd fds[2] = {{stopPipe[0], POLLIN, 0}, {listenFd, POLLIN, 0}};
+                if (poll(fds, socketMode ? 2 : 1, wait) < 0 && errno != EINTR)
+                    return;
+
+                if (fds[0].revents)
+                    return;
+
+                if (socketMode && (fds[1].revents & POLLIN)) {
+                    int fd = accept(listenFd, nullptr, nullptr);
+                    if (fd >= 0)
+                        serve(fd);
+                }
+            }
+        }
+    }
+
+    bool listen(const std::string& socketPath) {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(addr.sun_path))
+            return false;
+        std::memcpy(addr.sun_path, socketPath.data(), socketPath.size());
+
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd < 0)
+            return false;
+
+        unlink(socketPath.c_str());
+        return bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 && ::listen(listenFd, 16) == 0;
+    }
+
+    Metrics() :
+        workers(0),
+        phase("starting"),
+        origin(std::chrono::steady_clock::now()),
+        socketMode(false),
+        listenFd(-1),
+        stopPipe{-1, -1},
+        lastProgress(unixTime()),
+        enabled(false)
+    {
+        const char* target = getenv("HUF_METRICS");
+        if (!target || !*target)
+            return;
+
+        const char* interval = getenv("HUF_METRICS_INTERVAL");
+        int intervalMs = interval && atoi(interval) > 0 ? atoi(interval) : 1000;
+
+        path = target;
+        socketMode = path.rfind("unix:", 0) == 0;
+        if (socketMode) {
+            path = path.substr(5);
+            if (!listen(path)) {
+                std::cerr << "Could not listen on " << path << ", metrics disabled" << std::endl;
+                if (listenFd >= 0)
+                    close(listenFd);
+                return;
+            }
+        }
+
+        if (pipe(stopPipe) != 0) {
+            std::cerr << "Could not start the metrics exporter" << std::endl;
+            return;
+        }
+
+        busy.reset(new Counter[METRICS_MAX_WORKERS]);
+        lastBusy.reset(new long[METRICS_MAX_WORKERS]());
+        enabled = true;
+
+        exporter = std::thread(&Metrics::run, this, intervalMs);
+    }
+
+public:
+    bool enabled;
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    // The last snapshot, with the final counts, is left in the file
+    ~Metrics() {
+        if (!enabled)
+            return;
+
+        phase = "done";
+        char c = 0;
+        if (write(stopPipe[1], &c, 1) == 1 && exporter.joinable())
+            exporter.join();
+        else if (exporter.joinable())
+            exporter.detach();
+
+        update();
+
+        close(stopPipe[0]);
+        close(stopPipe[1]);
+        if (socketMode) {
+            close(listenFd);
+            unlink(path.c_str());
+        }
+    }
+
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    void add(const MetricsCounter c, const uint64_t n) {
+        counters[c].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    void addBusy(const int i, const long usecs) {
+        if (i < 0 || i >= METRICS_MAX_WORKERS)
+            return;
+
+        busy[i].value.fetch_add(usecs, std::memory_order_relaxed);
+
+        int nw = workers.load(std::memory_order_relaxed);
+        while (nw <= i && !workers.compare_exchange_weak(nw, i + 1, std::memory_order_relaxed));
+    }
+
+    void setPhase(const char* name) { phase.store(name, std::memory_order_relaxed); }
+};
+
+inline void metricsAdd(const MetricsCounter c, const uint64_t n) {
+    Metrics& m = Metrics::instance();
+    if (m.enabled)
+        m.add(c, n);
+}
+
+// Busy time of worker i, as the usecs of every task it completes
+inline void metricsBusy(const int i, const long usecs) {
+    Metrics& m = Metrics::instance();
+    if (m.enabled)
+        m.addBusy(i, usecs);
+}
+
+// Name of the phase starting, a string literal
+inline void metricsPhase(const char* name) {
+    Metrics& m = Metrics::instance();
+    if (m.enabled)
+        m.setPhase(name);
+}
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Topology-aware mode, for machines with several NUMA nodes such as the 2-socket reference
+    one: every worker is pinned to a CPU of one node, the pages of the input and of the
+    output are first touched, hence allocated, by the workers which go on using them, and
+    the chunks of a phase are dealt to the workers of the node holding their pages */
+
+// CPUs or nodes listed as in sysfs, e.g. "0-7,16-23"
+inline std::vector<int> parseList(const std::string& list) {
+    std::vector<int> items;
+
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+            end = list.size();
+
+        std::string range = list.substr(pos, end - pos);
+        size_t dash = range.find('-');
+        if (!range.empty()) {
+            int first = atoi(range.c_str());
+            int last = dash == std::string::npos ? first : atoi(range.c_str() + dash + 1);
+            for (int k = first; k <= last; ++k)
+                items.push_back(k);
+        }
+
+        pos = end + 1;
+    }
+
+    return items;
+}
+
+/* Nodes with CPUs and the placement of nw workers on them: the workers are spread over
+    the nodes in contiguous groups of (nearly) the same size, those of a node taking its
+    CPUs in turn */
+class Topology {
+    std::vector<int> ids;
+    std::vector<std::vector<int>> cpus;
+    int nw;
+
+    int group(const int i) const { return static_cast<int64_t>(i) * ids.size() / nw; }
+
+    // First worker of group g
+    int firstOf(const int g) const { return (static_cast<int64_t>(g) * nw + ids.size() - 1) / ids.size(); }
+
+public:
+    explicit Topology(const int nw) : nw(nw) {
+        std::ifstream online("/sys/devices/system/node/online");
+        std::string list;
+        if (online.is_open())
+            std::getline(online, list);
+
+        for (int node : parseList(list)) {
+            std::ifstream f("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            std::string cpuList;
+            if (!f.is_open() || !std::getline(f, cpuList))
+                continue;
+
+            std::vector<int> c = parseList(cpuList);
+            if (c.empty()) // Memory-only node
+                continue;
+
+            ids.push_back(node);
+            cpus.push_back(c);
+        }
+
+        // No NUMA information: a single node with the CPUs the process may run on
+        if (ids.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            sched_getaffinity(0, sizeof(set), &set);
+
+            std::vector<int> c;
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+                if (CPU_ISSET(cpu, &set))
+                    c.push_back(cpu);
+
+            ids.push_back(0);
+            cpus.push_back(c.empty() ? std::vector<int>{0} : c);
+        }
+    }
+
+    int nodes() const { return ids.size(); }
+
+    // Node of worker i
+    int nodeOf(const int i) const { return ids[group(i)]; }
+
+    // Node of every worker, by worker index
+    std::vector<int> workerNodes() const {
+        std::vector<int> nodes(nw);
+        for (int i = 0; i < nw; ++i)
+            nodes[i] = nodeOf(i);
+
+        return nodes;
+    }
+
+    // Pins the calling thread, which runs as worker i, to its CPU
+    bool pin(const int i) const {
+        const std::vector<int>& c = cpus[group(i)];
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(c[(i - firstOf(group(i))) % c.size()], &set);
+
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+    }
+
+    void print(std::ostream& os) const {
+        os << "Topology: " << ids.size() << " nodes, workers per node:";
+        for (int g = 0; g < nodes(); ++g)
+            os << " " << firstOf(g + 1) - firstOf(g);
+        os << std::endl;
+    }
+};
+
+// Node holding the page of every address, -1 where it is not known, such as pages never touched
+inline std::vector<int> pageNodes(const std::vector<const void*>& addresses) {
+    const uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+
+    std::vector<void*> pages;
+    for (const void* a : addresses)
+        pages.push_back(reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(a) / pageSize * pageSize));
+
+    std::vector<int> status(pages.size(), -1);
+    if (!pages.empty() && syscall(SYS_move_pages, 0, pages.size(), pages.data(), nullptr, status.data(), 0) != 0)
+        return std::vector<int>(pages.size(), -1);
+
+    for (int& s : status)
+        if (s < 0)
+            s = -1;
+
+    return status;
+}
+
+/* Input file read by the workers themselves into anonymous memory: with the pages of a
+    chunk first touched by the worker loading it, they are allocated on the node of that
+    worker instead of the one of the thread faulting in a mapping */
+class LoadedFile {
+    char* data;
+    uint64_t size;
+    int fd;
+
+public:
+    LoadedFile() : data(nullptr), size(0), fd(-1) {}
+
+    LoadedFile(const LoadedFile&) = delete;
+    LoadedFile& operator=(const LoadedFile&) = delete;
+
+    ~LoadedFile() {
+        if (data)
+            munmap(data, size);
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool open(const std::string& filename) {
+        fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Could not open the file" << std::endl;
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            std::cerr << "Could not open the file" << std::endl;
+            return false;
+        }
+
+        size = st.st_size;
+        if (!size)
+            return true;
+
+        // Reserved only: no page is allocated before its first touch
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) {
+            std::cerr << "Could not allocate the input" << std::endl;
+            size = 0;
+            return false;
+        }
+
+        // Huge pages would place up to 2 MiB, several chunks, on the node touching them first
+#ifdef MADV_NOHUGEPAGE
+        madvise(p, size, MADV_NOHUGEPAGE);
+#endif
+
+        data = static_cast<char*>(p);
+        return true;
+    }
+
+    // Reads bytes [from, to) of the file in place; safe to call concurrently on disjoint ranges
+    bool load(uint64_t from, const uint64_t to) {
+        while (from < to) {
+            ssize_t n = pread(fd, data + from, to - from, from);
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n <= 0) {
+                std::cerr << "Could not read the file" << std::endl;
+                return false;
+            }
+
+            from += n;
+        }
+
+        return true;
+    }
+
+    std::string_view view() const { return {data, size}; }
+};
+
+#endif
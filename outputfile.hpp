@@ -0,0 +1,99 @@
+#ifndef OUTPUTFILE_H
+#define OUTPUTFILE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Split points of the parallel writes fall on multiples of this in the file, so that no page is shared by two writers
+constexpr uint64_t WRITE_ALIGNMENT = 4096;
+
+// Largest single pwrite, keeping every call well below the limits of the kernel
+constexpr uint64_t WRITE_CHUNK = 64 * 1024 * 1024;
+
+/* Output file preallocated at its final size and shared by all the writers, each one
+    storing a disjoint range of it with pwrite(), hence with no seeks and no locking */
+class OutputFile {
+    int fd;
+    std::atomic<bool> ok;
+
+public:
+    OutputFile() : fd(-1), ok(false) {}
+
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    ~OutputFile() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    bool create(const std::string& filename, const uint64_t size) {
+        fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::cerr << "Could not create the file" << std::endl;
+            return false;
+        }
+
+        // Reserves the blocks up front where the file system allows it, otherwise just sets the size
+        if (size && fallocate(fd, 0, 0, size) != 0 && ftruncate(fd, size) != 0) {
+            std::cerr << "Could not allocate the file" << std::endl;
+            return false;
+        }
+
+        ok = true;
+        return true;
+    }
+
+    // Safe to call concurrently on disjoint ranges
+    bool write(const char* data, uint64_t size, uint64_t offset) {
+        while (size) {
+            ssize_t n = pwrite(fd, data, std::min(size, WRITE_CHUNK), offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n <= 0) {
+                std::cerr << "Could not write the file" << std::endl;
+                ok = false;
+                return false;
+            }
+
+            data += n;
+            size -= n;
+            offset += n;
+        }
+
+        return true;
+    }
+
+    // False if the file could not be created or any write failed
+    bool good() const { return ok; }
+
+    // For writers submitting their own requests, which report failures through setFailed()
+    int descriptor() const { return fd; }
+
+    void setFailed() { ok = false; }
+};
+
+/* Range [from, to) of the 'size' bytes stored at file offset 'base' which is written by
+    worker i of nw: an even split, with inner boundaries moved up to WRITE_ALIGNMENT */
+inline std::pair<uint64_t, uint64_t> writeRange(const uint64_t base, const uint64_t size, const int i, const int nw) {
+    auto boundary = [&](int k) -> uint64_t {
+        if (k == 0 || k == nw)
+            return k ? size : 0;
+
+        uint64_t aligned = (base + size / nw * k + WRITE_ALIGNMENT - 1) / WRITE_ALIGNMENT * WRITE_ALIGNMENT;
+        return std::min(aligned - base, size);
+    };
+
+    return {boundary(i), boundary(i + 1)};
+}
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Hardware counters per phase, enabled by setting the HUF_PERF environment variable: every
+    thread opens its own counters the first time it enters a phase, and the counts of each
+    phase are summed per thread and printed to stderr when the program exits, next to the
+    timings printed by the phases themselves. Counters which cannot be opened, as in most
+    virtual machines or with a restrictive perf_event_paranoid, are reported as unavailable
+    and the program runs as usual */
+
+constexpr int PERF_EVENTS = 4;
+
+inline const char* const PERF_NAMES[PERF_EVENTS] = {"cycles", "instructions", "LLC misses", "branch misses"};
+
+inline const uint64_t PERF_CONFIGS[PERF_EVENTS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+
+using PerfValues = std::array<uint64_t, PERF_EVENTS>;
+
+// Counters of a thread, each opened on its own so that a missing one does not disable the others
+class PerfThread {
+    std::array<int, PERF_EVENTS> fds;
+
+public:
+    long tid;
+    std::map<std::string, PerfValues> phases;
+
+    PerfThread() : tid(syscall(SYS_gettid)) {
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_CONFIGS[e];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+            // This thread only, on any CPU
+            fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        }
+    }
+
+    PerfThread(const PerfThread&) = delete;
+    PerfThread& operator=(const PerfThread&) = delete;
+
+    ~PerfThread() {
+        for (int fd : fds)
+            if (fd >= 0)
+                close(fd);
+    }
+
+    bool available(const int e) const { return fds[e] >= 0; }
+
+    // Current counts, scaled up when the kernel multiplexed the counters
+    PerfValues read() const {
+        PerfValues v{};
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            uint64_t buf[3];
+            if (fds[e] < 0 || ::read(fds[e], buf, sizeof(buf)) != sizeof(buf))
+                continue;
+
+            v[e] = buf[2] && buf[2] < buf[1] ? static_cast<uint64_t>(static_cast<double>(buf[0]) * buf[1] / buf[2]) : buf[0];
+        }
+
+        return v;
+    }
+};
+
+class PerfCounters {
+    std::mutex m;
+    std::vector<std::unique_ptr<PerfThread>> threads;
+
+    PerfCounters() : enabled(getenv("HUF_PERF") != nullptr) {}
+
+    static void printValues(const PerfValues& v, const std::array<bool, PERF_EVENTS>& available) {
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            std::cerr << ", " << PERF_NAMES[e] << " ";
+            if (available[e])
+                std::cerr << v[e];
+            else
+                std::cerr << "n/a";
+        }
+
+        // Instructions per cycle, and misses per thousand instructions
+        if (available[0] && available[1] && v[0])
+            std::cerr << ", IPC " << std::fixed << std::setprecision(2) << static_cast<double>(v[1]) / v[0];
+        if (available[1] && v[1]) {
+            if (available[2])
+                std::cerr << ", LLC MPKI " << std::fixed << std::setprecision(2) << 1000.0 * v[2] / v[1];
+            if (available[3])
+                std::cerr << ", branch MPKI " << std::fixed << std::setprecision(2) << 1000.0 * v[3] / v[1];
+        }
+        std::cerr << std::defaultfloat << std::endl;
+    }
+
+    void print() {
+        if (threads.empty())
+            return;
+
+        std::array<bool, PERF_EVENTS> available{};
+        bool any = false;
+        for (int e = 0; e < PERF_EVENTS; ++e) {
+            available[e] = threads[0]->available(e);
+            any = any || available[e];
+        }
+
+        if (!any) {
+            std::cerr << "Hardware counters unavailable" << std::endl;
+            return;
+        }
+
+        // Phases in order of name, each with its total over the threads and then by thread
+        std::map<std::string, PerfValues> totals;
+        for (const auto& t : threads)
+            for (const auto& [phase, v] : t->phases)
+                for (int e = 0; e < PERF_EVENTS; ++e)
+                    totals[phase][e] += v[e];
+
+        for (const auto& [phase, total] : totals) {
+            std::cerr << "Counters of " << phase;
+            printValues(total, available);
+
+            for (const auto& t : threads) {
+                auto it = t->phases.find(phase);
+                if (it == t->phases.end())
+                    continue;
+
+                std::cerr << "    thread " << t->tid << (t->tid == getpid() ? " (main)" : "");
+                printValues(it->second, available);
+            }
+        }
+    }
+
+public:
+    const bool enabled;
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters() { print(); }
+
+    static PerfCounters& instance() {
+        static PerfCounters counters;
+        return counters;
+    }
+
+    // Counters of a new thread, owned here so that their counts outlive the thread
+    PerfThread* add() {
+        auto t = std::make_unique<PerfThread>();
+
+        std::lock_guard lg(m);
+        threads.push_back(std::move(t));
+        return threads.back().get();
+    }
+};
+
+inline PerfThread* perfThread() {
+    thread_local PerfThread* t = PerfCounters::instance().add();
+    return t;
+}
+
+// Adds the counts of the calling thread during the lifetime of the object to the given phase
+class PerfPhase {
+    const char* name;
+    PerfThread* thread;
+    PerfValues start;
+
+public:
+    explicit PerfPhase(const char* name) : name(name), thread(nullptr), start{} {
+        if (!PerfCounters::instance().enabled)
+            return;
+
+        thread = perfThread();
+        start = thread->read();
+    }
+
+    PerfPhase(const PerfPhase&) = delete;
+    PerfPhase& operator=(const PerfPhase&) = delete;
+
+    ~PerfPhase() {
+        if (!thread)
+            return;
+
+        PerfValues stop = thread->read();
+        PerfValues& sum = thread->phases[name];
+        for (int e = 0; e < PERF_EVENTS; ++e)
+            sum[e] += stop[e] - start[e];
+    }
+};
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <sys/uio.h>
+
+#include "asyncio.hpp"
+#include "bitstream.hpp"
+#include "container.hpp"
+#include "trace.hpp"
+#include "perf.hpp"
+#include "metrics.hpp"
+
+// Number of buffers in each ring: reads run up to PIPELINE_DEPTH - 1 blocks ahead of the encoder
+constexpr unsigned PIPELINE_DEPTH = 4;
+
+// Requests in flight at most: a read and a write per buffer, and the final partial word
+constexpr unsigned PIPELINE_IO_DEPTH = 2 * PIPELINE_DEPTH + 1;
+
+/* Encoding pass overlapping I/O with computation, over the BLOCK_SIZE blocks of the
+    container: while block k is encoded, the reads of blocks k + 1, k + 2, ... and the
+    writes of blocks k - 1, k - 2, ... are in flight. Input blocks are read into a ring
+    of fixed buffers, and the full words of each encoded block are written from a second
+    ring at their final position after 'payloadOffset'; the last partial word of a block
+    is carried over to the next one. Records the sync point of every block in 'blocks',
+    returning the number of bits written through 'totalBits' */
+inline bool encodeFilePipelined(
+    AsyncIO& io,
+    const int inFd,
+    const uint64_t length,
+    const CodeTable& table,
+    const int outFd,
+    const uint64_t payloadOffset,
+    std::vector<BlockEntry>& blocks,
+    uint64_t& totalBits
+) {
+    const uint64_t nBlocks = blockCount(length);
+    blocks.resize(nBlocks);
+
+    unsigned maxLen = 1;
+    for (const Code& c : table)
+        maxLen = std::max(maxLen, c.len);
+
+    // Worst case of an encoded block, plus the word started by the carried bits
+    const uint64_t outWords = BLOCK_SIZE * maxLen / 64 + 2;
+
+    std::vector<std::unique_ptr<char[]>> in(PIPELINE_DEPTH);
+    std::vector<std::unique_ptr<uint64_t[]>> out(PIPELINE_DEPTH);
+    std::vector<iovec> buffers;
+
+    for (unsigned s = 0; s < PIPELINE_DEPTH; ++s) {
+        in[s].reset(new char[BLOCK_SIZE]);
+        buffers.push_back({in[s].get(), BLOCK_SIZE});
+    }
+    for (unsigned s = 0; s < PIPELINE_DEPTH; ++s) {
+        out[s].reset(new uint64_t[outWords]);
+        buffers.push_back({out[s].get(), outWords * 8});
+    }
+
+    io.registerBuffers(buffers);
+
+    // Remaining part of the request on a buffer, resubmitted after a short transfer
+    struct Pending {
+        char* buf;
+        uint64_t left;
+        uint64_t offset;
+        bool busy;
+    };
+
+    // Tags: 2 * slot for reads, 2 * slot + 1 for writes, TAIL_TAG for the final partial word
+    const uint64_t TAIL_TAG = 2 * PIPELINE_DEPTH;
+    std::vector<Pending> pending(2 * PIPELINE_DEPTH + 1, Pending{nullptr, 0, 0, false});
+    bool ok = true;
+
+    auto submit = [&](uint64_t tag) {
+        Pending& p = pending[tag];
+        bool write = tag & 1 || tag == TAIL_TAG;
+        int bufIndex = tag == TAIL_TAG ? -1 : (write ? PIPELINE_DEPTH : 0) + tag / 2;
+
+        IoRequest r{write, write ? outFd : inFd, p.buf, static_cast<uint32_t>(p.left), p.offset, tag, bufIndex};
+        if (!io.submit(r)) {
+            p.busy = false;
+            ok = false;
+        }
+    };
+
+    auto start = [&](uint64_t tag, char* buf, uint64_t size, uint64_t offset) {
+        pending[tag] = {buf, size, offset, true};
+        submit(tag);
+    };
+
+    /* Waits for one completion, resubmitting what is left of a short transfer. If waiting
+        fails, the requests in flight, one per busy tag, are drained before their buffers
+        may be released */
+    auto handle = [&]() {
+        TRACE_SPAN("io wait")
+        IoCompletion c;
+        if (!io.wait(c)) {
+            io.drain(std::count_if(pending.begin(), pending.end(), [](const Pending& p) { return p.busy; }));
+            std::fill(pending.begin(), pending.end(), Pending{nullptr, 0, 0, false});
+            ok = false;
+            return;
+        }
+
+        Pending& p = pending[c.tag];
+        if (c.result <= 0) {
+            p.busy = false;
+            ok = false;
+            return;
+        }
+
+        metricsAdd(c.tag & 1 || c.tag == TAIL_TAG ? BYTES_WRITTEN : BYTES_READ, c.result);
+
+        p.buf += c.result;
+        p.left -= c.result;
+        p.offset += c.result;
+
+        if (!p.left || !ok)
+            p.busy = false;
+        else
+            submit(c.tag);
+    };
+
+    auto blockLength = [&](uint64_t k) { return std::min(BLOCK_SIZE, length - k * BLOCK_SIZE); };
+
+    for (uint64_t k = 0; k < std::min<uint64_t>(PIPELINE_DEPTH, nBlocks); ++k)
+        start(2 * k, in[k].get(), blockLength(k), k * BLOCK_SIZE);
+
+    uint64_t bitPos = 0;
+    uint64_t carry = 0; // Bits of the last partial word, already big-endian
+
+    for (uint64_t k = 0; ok && k < nBlocks; ++k) {
+        unsigned slot = k % PIPELINE_DEPTH;
+
+        while (ok && (pending[2 * slot].busy || pending[2 * slot + 1].busy))
+            handle();
+        if (!ok)
+            break;
+
+        uint64_t* words = out[slot].get();
+        unsigned carryBits = bitPos % 64;
+        uint64_t n = blockLength(k);
+
+        blocks[k] = {bitPos, k * BLOCK_SIZE};
+
+        BitWriter writer(words, carryBits);
+        {
+            TRACE_SPAN("encode")
+            PerfPhase perf("encode");
+            encodeSymbols(in[slot].get(), in[slot].get() + n, table, writer);
+        }
+        metricsAdd(BYTES_ENCODED, n);
+
+        uint64_t end = writer.position(words);
+        uint64_t full = end / 64;
+        uint64_t word = writer.tail().word;
+
+        if (full) {
+            words[0] |= carry;
+            carry = word;
+            start(2 * slot + 1, reinterpret_cast<char*>(words), full * 8, payloadOffset + bitPos / 64 * 8);
+        } else {
+            carry |= word;
+        }
+
+        bitPos += end - carryBits;
+
+        // The input buffer is free again
+        if (k + PIPELINE_DEPTH < nBlocks)
+            start(2 * slot, in[slot].get(), blockLength(k + PIPELINE_DEPTH), (k + PIPELINE_DEPTH) * BLOCK_SIZE);
+    }
+
+    if (ok && bitPos % 64)
+        start(TAIL_TAG, reinterpret_cast<char*>(&carry), (bitPos % 64 + 7) / 8, payloadOffset + bitPos / 64 * 8);
+
+    // Buffers must outlive every request still in flight, even after a failure
+    while (std::any_of(pending.begin(), pending.end(), [](const Pending& p) { return p.busy; }))
+        handle();
+
+    if (!ok) {
+        std::cerr << "Could not read or write the file" << std::endl;
+        return false;
+    }
+
+    totalBits = bitPos;
+    return true;
+}
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "container.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+
+/* Dynamic load balancing: phases are split in many more chunks than workers, so that a
+    slow worker (a busy hyperthread sibling, a remote NUMA node) takes fewer of them
+    instead of bounding the whole phase with its static share */
+
+// Scheduling granularity, in chunks per worker
+constexpr int CHUNKS_PER_WORKER = 16;
+
+// Number of chunks splitting 'blocks' units of work among nw workers, never empty ones
+inline uint64_t chunkCount(const uint64_t blocks, const int nw) {
+    return std::max<uint64_t>(1, std::min<uint64_t>(blocks, static_cast<uint64_t>(nw) * CHUNKS_PER_WORKER));
+}
+
+// Units [from, to) of 'blocks' which belong to chunk c of n
+inline std::pair<uint64_t, uint64_t> chunkUnits(const uint64_t blocks, const uint64_t c, const uint64_t n) {
+    return {blocks * c / n, blocks * (c + 1) / n};
+}
+
+// Bytes [from, to) of a 'size' long input which belong to chunk c of n, starting on block boundaries
+inline std::pair<uint64_t, uint64_t> chunkBytes(const uint64_t size, const uint64_t c, const uint64_t n) {
+    auto [first, last] = chunkUnits(blockCount(size), c, n);
+    return {std::min(size, first * BLOCK_SIZE), std::min(size, last * BLOCK_SIZE)};
+}
+
+// Per-worker counters, each on its own cache line
+struct alignas(64) WorkerStats {
+    uint64_t tasks = 0;
+    uint64_t steals = 0;
+    long busy = 0; // usecs spent running tasks
+    uint64_t remote = 0; // Tasks whose pages are on another node than the worker, in topology-aware mode
+    long remoteBusy = 0;
+};
+
+inline void printWorkerStats(
+    const std::string& phase, 
+    const std::vector<WorkerStats>& stats, 
+    const bool stealing, 
+    const bool topology = false
+) {
+    uint64_t tasks = 0, steals = 0, remote = 0;
+    long busy = 0, remoteBusy = 0;
+    for (const WorkerStats& s : stats) {
+        tasks += s.tasks;
+        steals += s.steals;
+        remote += s.remote;
+        busy += s.busy;
+        remoteBusy += s.remoteBusy;
+    }
+
+    std::cout << phase << ": " << tasks << " chunks";
+    if (stealing)
+        std::cout << ", " << steals << " steals";
+    if (topology)
+        std::cout << ", local/remote chunks " << tasks - remote << "/" << remote
+            << ", local/remote busy usecs " << busy - remoteBusy << "/" << remoteBusy;
+    std::cout << ", busy usecs per worker:";
+    for (const WorkerStats& s : stats)
+        std::cout << " " << s.busy;
+    std::cout << std::endl;
+}
+
+/* Work-stealing over the task indices of a phase: every worker owns a deque holding a
+    contiguous range of indices, packed in a single atomic word. The owner takes tasks in
+    order from the front, keeping its accesses sequential; an idle worker steals the back
+    half of the largest range left, and continues from there as its owner.
+    When the node of every task and worker is known, the tasks are sorted by node and
+    the ranges of a node dealt to its workers, which steal from each other first */
+class WorkStealing {
+    struct alignas(64) Range {
+        std::atomic<uint64_t> bounds; // begin << 32 | end, positions in 'order'
+    };
+
+    std::unique_ptr<Range[]> ranges;
+    std::vector<WorkerStats> stats;
+    int nw;
+
+    std::vector<uint64_t> order; // Tasks by position
+    std::vector<int> taskNodes;
+    std::vector<int> workerNodes;
+
+    static uint64_t pack(uint64_t begin, uint64_t end) { return begin << 32 | end; }
+    static uint64_t begin(uint64_t r) { return r >> 32; }
+    static uint64_t end(uint64_t r) { return r & 0xffffffff; }
+
+    bool take(const int i, uint64_t& task) {
+        uint64_t r = ranges[i].bounds.load(std::memory_order_acquire);
+        while (begin(r) < end(r)) {
+            if (ranges[i].bounds.compare_exchange_weak(r, pack(begin(r) + 1, end(r)), std::memory_order_acq_rel)) {
+                task = order[begin(r)];
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Worker owning the largest range left, among the ones on the node of worker i only if 'sameNode'
+    int findVictim(const int i, const bool sameNode, uint64_t& r) {
+        int victim = -1;
+        uint64_t largest = 0;
+        for (int k = 1; k < nw; ++k) {
+            int v = (i + k) % nw;
+            if (sameNode && workerNodes[v] != workerNodes[i])
+                continue;
+
+            uint64_t rv = ranges[v].bounds.load(std::memory_order_acquire);
+            if (end(rv) > begin(rv) && end(rv) - begin(rv) > largest) {
+                victim = v;
+                r = rv;
+                largest = end(rv) - begin(rv);
+            }
+        }
+
+        return victim;
+    }
+
+    // Moves the back half of the largest range of the others into the empty range of worker i
+    bool steal(const int i) {
+        TRACE_SPAN("steal")
+        while (true) {
+            uint64_t r = 0;
+            int victim = taskNodes.empty() ? -1 : findVictim(i, true, r);
+            if (victim < 0)
+                victim = findVictim(i, false, r);
+
+            if (victim < 0)
+                return false;
+
+            uint64_t largest = end(r) - begin(r);
+
+            uint64_t middle = end(r) - (largest + 1) / 2;
+            if (ranges[victim].bounds.compare_exchange_strong(r, pack(begin(r), middle), std::memory_order_acq_rel)) {
+                // Nobody else modifies an empty range
+                ranges[i].bounds.store(pack(middle, end(r)), std::memory_order_release);
+                ++stats[i].steals;
+                return true;
+            }
+        }
+    }
+
+public:
+    explicit WorkStealing(const int nw) : ranges(new Range[nw]), stats(nw), nw(nw) {}
+
+    // Deals tasks [0, nTasks) in contiguous ranges, one per worker, and clears the stats
+    void reset(const uint64_t nTasks) {
+        order.resize(nTasks);
+        for (uint64_t t = 0; t < nTasks; ++t)
+            order[t] = t;
+        taskNodes.clear();
+
+        for (int i = 0; i < nw; ++i) {
+            auto [from, to] = chunkUnits(nTasks, i, nw);
+            ranges[i].bounds.store(pack(from, to), std::memory_order_relaxed);
+            stats[i] = WorkerStats();
+        }
+    }
+
+    /* Deals the tasks of every node to the workers of that node, given the node of every
+        worker, in non-decreasing order, and of every task. A task of unknown node (-1), or
+        of a node without workers, goes to the node of the worker the even split gives it to */
+    void reset(const uint64_t nTasks, const std::vector<int>& nodes, const std::vector<int>& workers) {
+        workerNodes = workers;
+        taskNodes = nodes;
+        for (uint64_t t = 0; t < nTasks; ++t)
+            if (std::find(workerNodes.begin(), workerNodes.end(), taskNodes[t]) == workerNodes.end())
+                taskNodes[t] = workerNodes[t * nw / nTasks];
+
+        order.resize(nTasks);
+        for (uint64_t t = 0; t < nTasks; ++t)
+            order[t] = t;
+        std::stable_sort(order.begin(), order.end(), [&](uint64_t a, uint64_t b) { return taskNodes[a] < taskNodes[b]; });
+
+        // The tasks of a node, now contiguous, are split evenly among the workers of the node
+        uint64_t first = 0;
+        for (int w = 0; w < nw;) {
+            int last = w;
+            while (last < nw && workerNodes[last] == workerNodes[w])
+                ++last;
+
+            uint64_t count = std::count(taskNodes.begin(), taskNodes.end(), workerNodes[w]);
+            for (int i = w; i < last; ++i) {
+                auto [from, to] = chunkUnits(count, i - w, last - w);
+                ranges[i].bounds.store(pack(first + from, first + to), std::memory_order_relaxed);
+                stats[i] = WorkerStats();
+            }
+
+            first += count;
+            w = last;
+        }
+    }
+
+    // Body of worker i in a phase: runs tasks until none is left to take or steal
+    void work(const int i, const std::function<void(uint64_t)>& task) {
+        uint64_t t;
+        while (true) {
+            if (!take(i, t)) {
+                if (!steal(i))
+                    return;
+                continue;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            task(t);
+            long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+            stats[i].busy += elapsed;
+            ++stats[i].tasks;
+            metricsBusy(i, elapsed);
+            if (!taskNodes.empty() && taskNodes[t] != workerNodes[i]) {
+                stats[i].remoteBusy += elapsed;
+                ++stats[i].remote;
+            }
+        }
+    }
+
+    // Valid once all the workers returned from work()
+    const std::vector<WorkerStats>& workerStats() const { return stats; }
+};
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef SELFSYNC_H
+#define SELFSYNC_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "bitstream.hpp"
+#include "decoder.hpp"
+
+/* Parallel decoding of streams without a block index, based on the self-synchronization
+    of Huffman codes: a decoder started at an arbitrary bit offset produces garbage for a
+    while, then falls on a symbol boundary of the true decoding and agrees with it from
+    there on. Each chunk is decoded speculatively from its first bit, then the chunks are
+    stitched in order by continuing the true decoding of the previous chunk until it meets
+    one of the symbol boundaries recorded by the speculative decoder.
+
+    These are the files compressed with the unindexed option, which leaves the block index
+    out of the header. A bit pattern matching no code, possible only with an incomplete
+    code, stops the speculative decoding of a chunk, as it may just be garbage preceding
+    the sync point, while it makes the true decoding fail, as the file is then corrupted */
+
+// Symbol boundaries recorded at the beginning of each chunk, bounding how late a sync can be found
+constexpr uint64_t SYNC_WINDOW = 4096;
+
+struct SpeculativeChunk {
+    std::string symbols;
+    std::vector<uint64_t> starts; // Bit positions of the first SYNC_WINDOW decoded symbols
+    uint64_t end = 0; // First symbol boundary at or after the end of the chunk, or where the decoding stopped
+    bool stopped = false; // The speculative decoding ran into a bit pattern matching no code
+
+    // Filled in by stitchChunk()
+    std::string bridge; // Symbols of the true decoding preceding the sync point
+    uint64_t validFrom = 0; // Index of the first symbol of 'symbols' agreeing with the true decoding
+    uint64_t wastedBits = 0; // Bits decoded speculatively before the sync point
+    bool synced = false;
+    bool corrupted = false; // The true decoding ran into a bit pattern matching no code
+
+    uint64_t size() const { return bridge.size() + symbols.size() - validFrom; }
+};
+
+// Decodes payload bits [fromBit, toBit), starting at fromBit as if it was a symbol boundary
+inline void decodeSpeculative(
+    const char* payload,
+    const uint64_t totalBits,
+    const DecodeTable& table,
+    const uint64_t fromBit,
+    const uint64_t toBit,
+    SpeculativeChunk& chunk
+) {
+    const DecodeEntry* entries = table.entries.data();
+    BitReader reader(payload, (totalBits + 7) / 8, fromBit);
+
+    uint64_t pos = fromBit;
+    while (pos < toBit) {
+        if (chunk.starts.size() < SYNC_WINDOW)
+            chunk.starts.push_back(pos);
+
+        reader.refill();
+        int sym = decodeSymbolChecked(entries, table.rootBits, reader);
+        if (sym < 0) {
+            chunk.stopped = true;
+            break;
+        }
+
+        chunk.symbols += static_cast<char>(sym);
+        pos = reader.position(payload);
+    }
+
+    chunk.end = pos;
+}
+
+// Appends the next symbol of the true decoding, returning false when no code matches the bits
+inline bool decodeTrue(const char* payload, const DecodeTable& table, BitReader& reader, std::string& out, uint64_t& pos) {
+    reader.refill();
+    int sym = decodeSymbolChecked(table.entries.data(), table.rootBits, reader);
+    if (sym < 0)
+        return false;
+
+    out += static_cast<char>(sym);
+    pos = reader.position(payload);
+    return true;
+}
+
+/* Continues the true decoding from 'pos', a symbol boundary preceding or equal to 'fromBit', until
+    it reaches one of the boundaries recorded for the chunk [fromBit, toBit). Without a sync in
+    the recorded window the whole chunk is decoded again. Returns the true end of the chunk, or
+    where the true decoding failed, marking the chunk as corrupted */
+inline uint64_t stitchChunk(
+    const char* payload,
+    const uint64_t totalBits,
+    const DecodeTable& table,
+    uint64_t pos,
+    const uint64_t fromBit,
+    const uint64_t toBit,
+    SpeculativeChunk& chunk
+) {
+    BitReader reader(payload, (totalBits + 7) / 8, pos);
+
+    uint64_t k = 0;
+    while (true) {
+        while (k < chunk.starts.size() && chunk.starts[k] < pos)
+            ++k;
+
+        if (k < chunk.starts.size() && chunk.starts[k] == pos) {
+            chunk.validFrom = k;
+            chunk.wastedBits = pos - fromBit;
+            chunk.synced = true;
+
+            // Past the sync point the speculative decoding is the true one, which has to reach the end
+            chunk.corrupted = chunk.stopped;
+
+            return chunk.end;
+        }
+
+        // All the recorded boundaries are behind, or the chunk is covered already
+        if (k == chunk.starts.size() || pos >= toBit)
+            break;
+
+        if (!decodeTrue(payload, table, reader, chunk.bridge, pos)) {
+            chunk.corrupted = true;
+            return pos;
+        }
+    }
+
+    // No sync within the window: the speculative work is discarded
+    while (pos < toBit) {
+        if (!decodeTrue(payload, table, reader, chunk.bridge, pos)) {
+            chunk.corrupted = true;
+            return pos;
+        }
+    }
+
+    chunk.validFrom = chunk.symbols.size();
+    chunk.wastedBits = toBit > fromBit ? toBit - fromBit : 0;
+
+    return pos;
+}
+
+#endif
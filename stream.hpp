@@ -0,0 +1,337 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "bitstream.hpp"
+#include "codes.hpp"
+#include "container.hpp"
+#include "decoder.hpp"
+#include "trace.hpp"
+#include "perf.hpp"
+#include "metrics.hpp"
+#include "histogram.hpp"
+#include "outputfile.hpp"
+
+/* Streaming mode: the input is cut in segments of a fixed size, each one compressed into
+    a self-contained frame (a whole container, with its own code table) which is written
+    as soon as it is encoded. A compressed stream is the sequence of the frames, hence
+    only the segments in flight are ever held in memory */
+
+constexpr uint64_t DEFAULT_MEMORY_CAP = 64 * 1024 * 1024;
+
+// Fixed part of a frame header, preceding the optional block index
+constexpr uint64_t FRAME_HEADER_SIZE = sizeof(CONTAINER_MAGIC) + 1 + 1 + 8 + 8 + 256;
+
+// Smallest segment, below which the frame headers would take a noticeable share of the output
+constexpr uint64_t MIN_SEGMENT_SIZE = 64 * 1024;
+
+/* Largest segment such that 'inFlight' segments fit in 'memoryCap' together with their
+    encodings, whose codes are at most 'maxLen' bits long: whole blocks of the container,
+    or whole multiples of MIN_SEGMENT_SIZE when not even a block fits. Returns 0, naming
+    the smallest cap that fits, when the cap cannot hold MIN_SEGMENT_SIZE segments */
+inline uint64_t segmentSize(const uint64_t memoryCap, const unsigned inFlight, const unsigned maxLen) {
+    uint64_t perSegment = memoryCap / inFlight * 8 / (8 + maxLen);
+    if (perSegment >= BLOCK_SIZE)
+        return perSegment / BLOCK_SIZE * BLOCK_SIZE;
+    if (perSegment >= MIN_SEGMENT_SIZE)
+        return perSegment / MIN_SEGMENT_SIZE * MIN_SEGMENT_SIZE;
+
+    const uint64_t MiB = 1024 * 1024;
+    uint64_t minimum = inFlight * MIN_SEGMENT_SIZE * (8 + maxLen) / 8;
+    std::cerr << "The memory cap cannot hold " << inFlight << " segments in flight: it must be at least "
+        << (minimum + MiB - 1) / MiB << " MiB" << std::endl;
+
+    return 0;
+}
+
+// Fills 'buf' up to 'size' bytes, returning fewer only at the end of the input, or -1
+inline int64_t readFull(const int fd, char* buf, const uint64_t size) {
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, buf + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+
+        done += n;
+    }
+
+    return done;
+}
+
+inline bool writeFull(const int fd, const char* buf, uint64_t size) {
+    while (size) {
+        ssize_t n = write(fd, buf, std::min(size, WRITE_CHUNK));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        buf += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// A segment of the input and its frame
+struct Segment {
+    std::unique_ptr<char[]> data;
+    uint64_t size = 0;
+    std::string header;
+    BitBuffer compressed;
+};
+
+// Compresses a segment into its frame, with the same codes as the whole-file programs would use on it
+inline void compressSegment(Segment& s, const unsigned maxLen) {
+    Histogram histogram{};
+    {
+        TRACE_SPAN("histogram")
+        PerfPhase perf("histogram");
+        countSymbols(s.data.get(), s.data.get() + s.size, histogram);
+    }
+
+    std::vector<char> symbols;
+    std::vector<uint64_t> freqs;
+    populateSymbolsAndFrequencies(histogram, symbols, freqs);
+
+    CodeLengths lengths;
+    {
+        TRACE_SPAN("tree")
+        PerfPhase perf("tree");
+        lengths = huffmanCodeLengths(symbols, freqs);
+        if (maxCodeLength(lengths) > maxLen)
+            lengths = packageMerge(symbols, freqs, maxLen);
+    }
+
+    ContainerHeader header;
+    header.originalLength = s.size;
+    header.codeTable = canonicalCodes(lengths);
+    header.totalBits = encodedBits(histogram, header.codeTable);
+    header.blocks.resize(blockCount(s.size));
+    header.streamed = true;
+
+    s.compressed.allocate(header.totalBits);
+
+    TRACE_SPAN("encode")
+    PerfPhase perf("encode");
+    BitWriter writer(s.compressed.words.get(), 0);
+    encodeBlocks(s.data.get(), 0, s.size, header.codeTable, writer, s.compressed.words.get(), header.blocks);
+    writer.finish();
+
+    s.header = serializeHeader(header);
+}
+
+/* Compression of a stream shared by any number of workers, each running work(): a worker
+    takes the next segment of the input, compresses it, and appends its frame to the output
+    once the frames of all the previous segments are written */
+class StreamCompressor {
+    int inFd;
+    int outFd;
+    uint64_t segment;
+    unsigned maxLen;
+
+    std::mutex readMutex;
+    uint64_t nextRead;
+    bool eof;
+
+    std::mutex writeMutex;
+    std::condition_variable turn;
+    uint64_t nextWrite;
+    bool ok;
+
+    uint64_t inBytes;
+    uint64_t outBytes;
+
+    void fail() {
+        std::unique_lock ul(writeMutex);
+        ok = false;
+        turn.notify_all();
+    }
+
+public:
+    StreamCompressor(int inFd, int outFd, uint64_t segment, unsigned maxLen) :
+        inFd(inFd), outFd(outFd), segment(segment), maxLen(maxLen),
+        nextRead(0), eof(false), nextWrite(0), ok(true), inBytes(0), outBytes(0) {}
+
+    void work() {
+        Segment s;
+        s.data.reset(new char[segment]);
+
+        while (true) {
+            uint64_t k;
+            {
+                TRACE_SPAN("read")
+                PerfPhase perf("read");
+                std::unique_lock ul(readMutex);
+                if (eof)
+                    return;
+
+                int64_t n = readFull(inFd, s.data.get(), segment);
+                if (n < 0) {
+                    std::cerr << "Could not read the input" << std::endl;
+                    eof = true;
+                    ul.unlock();
+                    fail();
+                    return;
+                }
+
+                eof = static_cast<uint64_t>(n) < segment;
+                if (n == 0)
+                    return;
+
+                s.size = n;
+                k = nextRead++;
+            }
+            metricsAdd(BYTES_READ, s.size);
+
+            compressSegment(s, maxLen);
+            metricsAdd(BYTES_ENCODED, s.size);
+
+            std::unique_lock ul(writeMutex);
+            {
+                TRACE_SPAN("wait")
+                turn.wait(ul, [&] { return nextWrite == k || !ok; });
+            }
+            if (!ok)
+                return;
+
+            TRACE_SPAN("write")
+            PerfPhase perf("write");
+            if (!writeFull(outFd, s.header.data(), s.header.size()) ||
+                !writeFull(outFd, s.compressed.bytes(), s.compressed.byteSize())) {
+                std::cerr << "Could not write the output" << std::endl;
+                ok = false;
+            }
+
+            inBytes += s.size;
+            outBytes += s.header.size() + s.compressed.byteSize();
+            metricsAdd(BYTES_WRITTEN, s.header.size() + s.compressed.byteSize());
+
+            ++nextWrite;
+            turn.notify_all();
+        }
+    }
+
+    // Valid once all the workers returned from work()
+    bool good() const { return ok; }
+    uint64_t frames() const { return nextWrite; }
+    uint64_t bytesIn() const { return inBytes; }
+    uint64_t bytesOut() const { return outBytes; }
+};
+
+/* Decodes a compressed stream frame by frame, writing each segment as soon as it is
+    decoded; the memory in use is bounded by the largest frame */
+inline bool decompressStream(const int inFd, const int outFd) {
+    std::string frame;
+    std::string out;
+
+    while (true) {
+        frame.resize(FRAME_HEADER_SIZE);
+        int64_t n = readFull(inFd, frame.data(), FRAME_HEADER_SIZE);
+        if (n == 0)
+            return true;
+
+        HeaderParser p(frame.data() + sizeof(CONTAINER_MAGIC), FRAME_HEADER_SIZE - sizeof(CONTAINER_MAGIC));
+        uint64_t version, flags, originalLength, totalBits, count = 0;
+        bool ok = n == static_cast<int64_t>(FRAME_HEADER_SIZE) && p.get(version, 1) && p.get(flags, 1) &&
+            p.get(originalLength, 8) && p.get(totalBits, 8);
+
+        // Every symbol takes from 1 to MAX_CODE_LENGTH bits, which bounds the sizes read from the header
+        ok = ok && originalLength <= totalBits && totalBits / MAX_CODE_LENGTH <= originalLength;
+
+        // The block index, then the payload, follow the fixed part of the header
+        if (ok && (flags & FLAG_BLOCK_INDEX)) {
+            frame.resize(FRAME_HEADER_SIZE + 8);
+            ok = readFull(inFd, frame.data() + FRAME_HEADER_SIZE, 8) == 8;
+
+            HeaderParser c(frame.data() + FRAME_HEADER_SIZE, 8);
+            ok = ok && c.get(count, 8) && count <= blockCount(originalLength);
+        }
+
+        // Grown a chunk at a time, so that a truncated stream fails before allocating its declared size
+        uint64_t rest = ok ? (flags & FLAG_BLOCK_INDEX ? 16 * count : 0) + (totalBits + 7) / 8 : 0;
+        while (ok && rest) {
+            uint64_t at = frame.size();
+            uint64_t step = std::min(rest, WRITE_CHUNK);
+
+            frame.resize(at + step);
+            ok = readFull(inFd, frame.data() + at, step) == static_cast<int64_t>(step);
+            rest -= step;
+        }
+
+        ContainerHeader header;
+        uint64_t payloadOffset;
+        if (!ok || !parseHeader(frame.data(), frame.size(), header, payloadOffset)) {
+            std::cerr << "Truncated or corrupted compressed stream" << std::endl;
+            return false;
+        }
+        metricsAdd(BYTES_READ, frame.size());
+
+        {
+            TRACE_SPAN("decode")
+            PerfPhase perf("decode");
+            DecodeTable decodeTable(header.codeTable);
+            out.resize(header.originalLength);
+
+            BitReader reader(frame.data() + payloadOffset, (header.totalBits + 7) / 8, 0);
+            decodeSymbols(decodeTable, reader, out.data(), header.originalLength);
+        }
+        metricsAdd(BYTES_DECODED, out.size());
+
+        if (!writeFull(outFd, out.data(), out.size())) {
+            std::cerr << "Could not write the output" << std::endl;
+            return false;
+        }
+        metricsAdd(BYTES_WRITTEN, out.size());
+    }
+}
+
+/* Descriptors of a streaming run: "-" stands for stdin and stdout, otherwise the output
+    file is named after the input as in the other modes */
+inline bool openStream(const std::string& filename, const std::string& prefix, int& inFd, int& outFd) {
+    if (filename == "-") {
+        inFd = STDIN_FILENO;
+        outFd = STDOUT_FILENO;
+        return true;
+    }
+
+    inFd = open(filename.c_str(), O_RDONLY);
+    if (inFd < 0) {
+        std::cerr << "Could not open the file" << std::endl;
+        return false;
+    }
+
+    outFd = open((prefix + filename).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outFd < 0) {
+        std::cerr << "Could not create the file" << std::endl;
+        close(inFd);
+        return false;
+    }
+
+    return true;
+}
+
+inline void closeStream(const int inFd, const int outFd) {
+    if (inFd != STDIN_FILENO)
+        close(inFd);
+    if (outFd != STDOUT_FILENO)
+        close(outFd);
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "trace.hpp"
+
+/* Persistent pool of nw workers, spawned once and reused by every phase of the programs
+    and across files. A phase runs the same function on all the workers, worker i getting
+    index i as the threads spawned per phase did, and returns at the barrier where all of
+    them are done. Independent tasks can also be submitted and waited for */
+class ThreadPool {
+    std::mutex m;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    const std::function<void(int)>* phase;
+    uint64_t generation; // Number of phases started so far
+    int running; // Workers still in the current phase
+
+    std::deque<std::function<void()>> tasks;
+    int activeTasks;
+
+    bool stop;
+    std::vector<std::thread> workers;
+
+    void serve(const int id) {
+        uint64_t seen = 0;
+        TRACE_THREAD("worker", id)
+
+        std::unique_lock ul(m);
+        while (true) {
+            wake.wait(ul, [&] { return stop || generation != seen || !tasks.empty(); });
+
+            if (generation != seen) {
+                seen = generation;
+                const std::function<void(int)>& f = *phase;
+
+                ul.unlock();
+                f(id);
+                ul.lock();
+
+                if (--running == 0)
+                    done.notify_all();
+            } else if (!tasks.empty()) {
+                std::function<void()> task = std::move(tasks.front());
+                tasks.pop_front();
+                ++activeTasks;
+
+                ul.unlock();
+                task();
+                ul.lock();
+
+                if (--activeTasks == 0 && tasks.empty())
+                    done.notify_all();
+            } else {
+                return;
+            }
+        }
+    }
+
+public:
+    explicit ThreadPool(const int nw) : phase(nullptr), generation(0), running(0), activeTasks(0), stop(false) {
+        for (int i = 0; i < nw; ++i)
+            workers.emplace_back(&ThreadPool::serve, this, i);
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::unique_lock ul(m);
+            stop = true;
+        }
+        wake.notify_all();
+
+        for (std::thread& t : workers)
+            t.join();
+    }
+
+    int size() const { return workers.size(); }
+
+    // Runs f(i) on every worker i, returning once all of them are done; not to be called by the workers
+    void run(const std::function<void(int)>& f) {
+        std::unique_lock ul(m);
+        phase = &f;
+        running = workers.size();
+        ++generation;
+        wake.notify_all();
+
+        TRACE_SPAN("barrier")
+        done.wait(ul, [&] { return running == 0; });
+    }
+
+    // Runs 'task' on the first idle worker
+    void submit(std::function<void()> task) {
+        std::unique_lock ul(m);
+        tasks.push_back(std::move(task));
+        wake.notify_one();
+    }
+
+    // Waits for all the submitted tasks
+    void wait() {
+        TRACE_SPAN("barrier")
+        std::unique_lock ul(m);
+        done.wait(ul, [&] { return tasks.empty() && activeTasks == 0; });
+    }
+};
+
+#endif
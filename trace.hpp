@@ -0,0 +1,131 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Timeline of the phases run by every thread, written as a Chrome trace to be opened with
+    chrome://tracing or ui.perfetto.dev. Compiled in only with -DHUF_TRACE (make TRACE=1),
+    otherwise the macros expand to nothing. Every thread appends its spans to a buffer of
+    its own, without locking; the buffers are written when the program exits, to the file
+    named by the HUF_TRACE environment variable or to trace.json */
+
+#ifdef HUF_TRACE
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Times in nsecs since the tracer started
+struct TraceEvent {
+    const char* name;
+    int64_t start;
+    int64_t duration;
+};
+
+// Buffer of a thread, identified as in the kernel
+struct TraceThread {
+    long tid;
+    std::string name;
+    std::vector<TraceEvent> events;
+};
+
+class Tracer {
+    std::mutex m;
+    std::vector<std::unique_ptr<TraceThread>> threads;
+    const std::chrono::steady_clock::time_point origin;
+
+    Tracer() : origin(std::chrono::steady_clock::now()) {}
+
+    void dump() {
+        const char* path = getenv("HUF_TRACE");
+        std::ofstream out(path ? path : "trace.json");
+        if (!out.is_open()) {
+            std::cerr << "Could not write the trace" << std::endl;
+            return;
+        }
+
+        // Timestamps are in usecs
+        out << std::fixed << std::setprecision(3);
+        out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+        bool first = true;
+        for (const auto& t : threads) {
+            out << (first ? "" : ",") << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": " << getpid() << ", \"tid\": " << t->tid
+                << ", \"args\": {\"name\": \"" << t->name << "\"}}";
+            first = false;
+
+            for (const TraceEvent& e : t->events)
+                out << ",\n{\"name\": \"" << e.name << "\", \"ph\": \"X\", \"pid\": " << getpid() << ", \"tid\": " << t->tid
+                    << ", \"ts\": " << e.start / 1000.0 << ", \"dur\": " << e.duration / 1000.0 << "}";
+        }
+        out << "\n]}\n";
+    }
+
+public:
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    ~Tracer() { dump(); }
+
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - origin).count();
+    }
+
+    // Buffer of a new thread, owned by the tracer so that it outlives the thread
+    TraceThread* add() {
+        std::lock_guard lg(m);
+        auto t = std::make_unique<TraceThread>();
+        t->tid = syscall(SYS_gettid);
+        t->name = t->tid == getpid() ? "main" : "thread " + std::to_string(t->tid);
+        t->events.reserve(4096);
+        threads.push_back(std::move(t));
+
+        return threads.back().get();
+    }
+};
+
+inline TraceThread* traceThread() {
+    thread_local TraceThread* t = Tracer::instance().add();
+    return t;
+}
+
+// Records the lifetime of the object as a span of the calling thread
+class TraceSpan {
+    const char* name;
+    int64_t start;
+
+public:
+    explicit TraceSpan(const char* name) : name(name), start(Tracer::instance().now()) {}
+
+    ~TraceSpan() {
+        int64_t stop = Tracer::instance().now();
+        traceThread()->events.push_back({name, start, stop - start});
+    }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(traceSpan, __LINE__)(name);
+#define TRACE_THREAD(label, i) traceThread()->name = std::string(label) + " " + std::to_string(i);
+
+#else
+
+#define TRACE_SPAN(name)
+#define TRACE_THREAD(label, i)
+
+#endif
+
+#endif
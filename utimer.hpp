@@ -3,13 +3,13 @@
 #include <chrono>
 
 
-#define START(timename) auto timename = std::chrono::system_clock::now();
-#define STOP(timename,elapsed)  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now() - timename).count();
+#define START(timename) auto timename = std::chrono::steady_clock::now();
+#define STOP(timename,elapsed)  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - timename).count();
 
 
 class utimer {
-  std::chrono::system_clock::time_point start;
-  std::chrono::system_clock::time_point stop;
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point stop;
   std::string message; 
   using usecs = std::chrono::microseconds;
   using msecs = std::chrono::milliseconds;
@@ -20,16 +20,16 @@ private:
 public:
 
   utimer(const std::string m) : message(m),us_elapsed((long *)NULL) {
-    start = std::chrono::system_clock::now();
+    start = std::chrono::steady_clock::now();
   }
     
   utimer(const std::string m, long * us) : message(m),us_elapsed(us) {
-    start = std::chrono::system_clock::now();
+    start = std::chrono::steady_clock::now();
   }
 
   ~utimer() {
     stop =
-      std::chrono::system_clock::now();
+      std::chrono::steady_clock::now();
     std::chrono::duration<double> elapsed =
       stop - start;
     auto musec =